@@ -1,6 +1,8 @@
+#define _GNU_SOURCE		// fallocate()
 #include <stdio.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -8,6 +10,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "inner.h"
 
@@ -15,37 +18,88 @@ typedef uint32_t ckid_t;	//chunk id
 typedef uint32_t lpid_t;	//local page id
 #define NULL_CK	((uint64_t)(-1L))
 
+#define SUM_WLEN	(PAGE_BITMAP_WLEN/64)
+
+#define NEAR_PAGES	(256)	// how far after its hint alloc_page_near() looks
+#define EXTENT_PAGES	(8)	// pages set aside at a time for splits near a page
+#define EXTENT_NUM	(64)	// extents set aside at most
+#define HOLE_MIN_PAGES	(16)	// free runs shorter than it are not punched out
+
+/*
+ * The page bitmap of the current chunk is searched a word at a time. sum has
+ * a bit for each word of it which has a free page, and no word before hint
+ * has one, so a page is found with a couple of ctz in the usual case. The
+ * bitmap of the last other chunk a page has been freed in stays mapped too.
+ */
 struct allocator_s {
+	pthread_mutex_t lock;
 	ckid_t curr_ck;
 	struct busy_page_num_s *bpn;
 	struct page_bitmap_s *pb;
+	uint64_t sum[SUM_WLEN];
+	uint32_t hint;
+	ckid_t other_ck;		// the chunk other_pb is the bitmap of
+	struct page_bitmap_s *other_pb;	// pages of other chunks are freed in it
+	struct {
+		gpid_t hint;		// the page it has been taken for
+		gpid_t start;		// the first page, handed out to hint
+		gpid_t next;		// the next page to hand out
+		gpid_t end;
+	} ext[EXTENT_NUM];		// used in the bitmaps, see alloc_page_near()
+	uint32_t ext_hand;		// the extent to give back next
 };
 
+/*
+ * file_allocate() -- make sure [pos, pos+len) of the file is allocated and
+ * mark it used. The file grows by an extent, FILE_GROW_STEP bytes or else a
+ * quarter of its size between FILE_GROW_MIN and FILE_GROW_MAX, so that new 
+ * pages are seldom allocated by the kernel one at a time. file_size is what
+ * has been allocated, used_size the end of what has been handed out.
+ */
 void file_allocate(kvdb_t db, uint64_t pos, uint64_t len)
 {
 	struct file_header_s *h = db->h;
+	uint64_t end = pos + len, size, step;
 	int ret;
 
-	if (h->file_size>=pos+len) {
+	if (h->used_size<end) {
+		h->used_size = end;
+	}
+	if (h->file_size>=end) {
 		return;
 	}
-	ret = posix_fallocate(db->fd, pos, len);
+	step = FILE_GROW_STEP;
+	if (step==0) {
+		step = h->file_size / 4;
+		step = step<FILE_GROW_MIN ? FILE_GROW_MIN : step;
+		step = step>FILE_GROW_MAX ? FILE_GROW_MAX : step;
+	}
+	size = h->file_size + step;
+	if (size<end) {
+		size = end;
+	}
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	ret = posix_fallocate(db->fd, h->file_size, size - h->file_size);
 	kvdb_assert(ret==0);
-	h->file_size = pos + len;
+	stat_add(db, STAT_FALLOCATE, 1);
+	stat_add(db, STAT_FALLOCATE_BYTES, size - h->file_size);
+	h->file_size = size;
+	grow_cache_area(db, h->file_size);
 }
 
-	/* find a chunk which has free pages to allocate 
-	 * return r if success
-	 * return (ckid_t)-1 if failed 
-     */
-static ckid_t find_ck(kvdb_t db, ckid_t ck)
+/*
+ * find_ck() -- find a chunk, from ck on, which has need free pages at least
+ * return the chunk if success
+ * return (ckid_t)-1 if failed 
+ */
+static ckid_t find_ck(kvdb_t db, ckid_t ck, uint32_t need)
 {
 	ckid_t i, r; 
 	struct allocator_s *alc = db->alc;
 
 	for (i=0; i<MAX_CHUNK_NUM; i++) {
 		r = (ck + i) % MAX_CHUNK_NUM;
-		if (alc->bpn->n[i]<PAGE_NUM_PER_CK) {
+		if (alc->bpn->n[r] + need <= PAGE_NUM_PER_CK) {
 			return r;
 		}
 	}
@@ -81,6 +135,8 @@ static void close_curr_ck(kvdb_t db)
 
 	ret = msync(alc->pb, PAGE_BITMAP_LEN, MS_SYNC);
 	kvdb_assert(ret==0); 
+	stat_add(db, STAT_MSYNC, 1);
+	stat_add(db, STAT_MSYNC_BYTES, PAGE_BITMAP_LEN);
 
 	ret = munmap(alc->pb, PAGE_BITMAP_LEN);
 	kvdb_assert(ret==0); 
@@ -89,31 +145,59 @@ static void close_curr_ck(kvdb_t db)
 	alc->pb = NULL;
 }
 
-/* to check if the bitmap is set*/
-static int pb_isset(kvdb_t db, lpid_t pg)
+static int pb_isset(struct page_bitmap_s *pb, lpid_t pg)
 {
-	uint32_t w = pg >> 6;
-	uint32_t b = pg & 63;
-	
-	return (db->alc->pb->w[w] & (1<<b))!=0; 
+	return (pb->w[pg >> 6] & (1ULL << (pg & 63)))!=0; 
 }
 
-/* set the bitmap's first two bytes all 1  */
-static void pb_set(kvdb_t db, lpid_t pg)
+static void pb_set(struct page_bitmap_s *pb, lpid_t pg)
 {
-	uint32_t w = pg >> 6;
-	uint32_t b = pg & 63;
+	pb->w[pg >> 6] |= 1ULL << (pg & 63);
+}
 
-	db->alc->pb->w[w] |= (1<<b);
+static void pb_clr(struct page_bitmap_s *pb, lpid_t pg)
+{
+	pb->w[pg >> 6] &= ~(1ULL << (pg & 63));
 }
 
-/* clear the bitmap */
-static void pb_clr(kvdb_t db, lpid_t pg)
+/* keep the bit of the w-th word of the current bitmap in sum right */
+static void sum_update(struct allocator_s *alc, uint32_t w)
 {
-	uint32_t w = pg >> 6;
-	uint32_t b = pg & 63;
-	
-	db->alc->pb->w[w] &= ~(1<<b);
+	if (alc->pb->w[w]==~0ULL) {
+		alc->sum[w >> 6] &= ~(1ULL << (w & 63));
+	} else {
+		alc->sum[w >> 6] |= 1ULL << (w & 63);
+	}
+}
+
+static struct page_bitmap_s *map_pb(kvdb_t db, ckid_t ck)
+{
+	struct page_bitmap_s *pb;
+
+	pb = mmap(NULL, sizeof(struct page_bitmap_s), PROT_READ|PROT_WRITE, 
+			MAP_SHARED, db->fd, get_ck_pos(ck));
+	kvdb_assert(pb!=MAP_FAILED);
+	return pb;
+}
+
+/* the bitmap of any chunk, the one of a chunk not current is mapped at other_pb */
+static struct page_bitmap_s *ck_pb(kvdb_t db, ckid_t ck)
+{
+	struct allocator_s *alc = db->alc;
+	int ret;
+
+	if (ck==alc->curr_ck) {
+		return alc->pb;
+	}
+	if (alc->other_pb==NULL || alc->other_ck!=ck) {
+		if (alc->other_pb!=NULL) {
+			ret = munmap(alc->other_pb, PAGE_BITMAP_LEN);
+			kvdb_assert(ret==0);
+		}
+		alc->other_pb = map_pb(db, ck);
+		alc->other_ck = ck;
+	}
+	return alc->other_pb;
 }
 
 /* 
@@ -125,7 +209,7 @@ static void open_ck(kvdb_t db, ckid_t ck)
 	uint64_t pos;
 	struct allocator_s *alc = db->alc; 
 	int new = 0;
-	lpid_t i;
+	uint32_t i;
 	
 	kvdb_assert(alc->curr_ck==(ckid_t)-1);
 	kvdb_assert(ck != (ckid_t)-1);
@@ -134,93 +218,626 @@ static void open_ck(kvdb_t db, ckid_t ck)
 	pos = get_ck_pos(ck);
 	//check if busy page num == 0 and enough memory to allocate
 	if (alc->bpn->n[ck]==0) {
-		if (db->h->file_size < pos+PAGE_BITMAP_LEN) {
-			file_allocate(db, pos, PAGE_BITMAP_LEN);
-		}
+		file_allocate(db, pos, PAGE_BITMAP_LEN);
 		new = 1;
 	}
-	alc->pb = mmap(NULL, sizeof(struct page_bitmap_s), 
-			PROT_READ|PROT_WRITE, MAP_SHARED, 
-			db->fd, pos);
-	kvdb_assert(alc->bpn!=MAP_FAILED);
+	alc->pb = map_pb(db, ck);
 	if (new) {
 		alc->bpn->n[ck] = PAGE_BITMAP_PAGES;
 		for (i=0; i<PAGE_BITMAP_PAGES; i++) {
-			pb_set(db, i);
+			pb_set(alc->pb, i);
 		}
 	}
+
+	memset(alc->sum, 0, sizeof(alc->sum));
+	for (i=0; i<PAGE_BITMAP_WLEN; i++) {
+		alc->sum[i >> 6] |= (uint64_t)(alc->pb->w[i]!=~0ULL) << (i & 63);
+	}
+	alc->hint = 0;
 }
 
-gpid_t alloc_page(kvdb_t db)
+/* the first word of the current bitmap from hint on with a free page */
+static uint32_t find_free_word(struct allocator_s *alc)
+{
+	uint32_t i = alc->hint >> 6;
+	uint64_t s;
+
+	s = alc->sum[i] & (~0ULL << (alc->hint & 63));
+	while (s==0) {
+		i ++;
+		kvdb_assert(i<SUM_WLEN);
+		s = alc->sum[i];
+	}
+	return (i << 6) + __builtin_ctzll(s);
+}
+
+/* 
+ * find_run() -- the first of n free pages in a row in the current bitmap, 
+ * or -1 if there are not so many.
+ */
+static int64_t find_run(struct allocator_s *alc, uint32_t n)
+{
+	uint64_t x;
+	uint32_t w, b, run = 0;
+	int64_t start = -1;
+
+	for (w=alc->hint; w<PAGE_BITMAP_WLEN; w++) {
+		x = alc->pb->w[w];
+		if (x==~0ULL) {
+			run = 0;
+			continue;
+		}
+		if (x==0) {
+			if (run==0) {
+				start = (int64_t)w << 6;
+			}
+			run += 64;
+		} else {
+			for (b=0; b<64; b++) {
+				if (x & (1ULL << b)) {
+					run = 0;
+					continue;
+				}
+				if (run==0) {
+					start = ((int64_t)w << 6) + b;
+				}
+				if (++run>=n) {
+					return start;
+				}
+			}
+		}
+		if (run>=n) {
+			return start;
+		}
+	}
+	return -1;
+}
+
+/* mark n pages from lpid on in the current chunk used, return the first one */
+static gpid_t take_pages(kvdb_t db, lpid_t lpid, uint32_t n)
 {
 	struct allocator_s *alc = db->alc; 
-	ckid_t ck = alc->curr_ck; 
-	lpid_t lpid;
-	gpid_t gpid; 
-	uint64_t pos;
+	gpid_t gpid;
+	uint32_t i;
+
+	for (i=0; i<n; i++) {
+		pb_set(alc->pb, lpid + i);
+	}
+	for (i=lpid >> 6; i<=(lpid + n - 1) >> 6; i++) {
+		sum_update(alc, i);
+	}
+	alc->bpn->n[alc->curr_ck] += n; 
+
+	gpid = get_gpid(alc->curr_ck, lpid);
+	file_allocate(db, get_page_pos(gpid), n * PAGE_SIZE);
+	log_new_pages(db, get_page_pos(gpid), n);
+	return gpid;
+}
 
+/*
+ * alloc_pages() -- allocate n pages in a row, in one chunk, and return the
+ * first one. The current chunk is left for another one if it has not so many
+ * pages free in a row. get_pages() is the same with alc->lock held.
+ */
+static gpid_t get_pages(kvdb_t db, uint32_t n)
+{
+	struct allocator_s *alc = db->alc; 
+	ckid_t ck; 
+	int64_t lpid;
+	uint32_t w;
+
+	kvdb_assert(n>0 && n<=PAGE_NUM_PER_CK-PAGE_BITMAP_PAGES);
+	ck = alc->curr_ck;
 	kvdb_assert(ck!=(ckid_t)-1);
 
-	/* 
-	 * If there is not any free page in the chunk, then we find the next one 
-	 * and turn to it */
-	if (alc->bpn->n[ck]>=PAGE_NUM_PER_CK) {
+	for (;;) {
+		if (alc->bpn->n[ck] + n <= PAGE_NUM_PER_CK) {
+			if (n==1) {
+				w = find_free_word(alc);
+				lpid = ((int64_t)w << 6) + __builtin_ctzll(~alc->pb->w[w]);
+				alc->hint = w;
+			} else {
+				lpid = find_run(alc, n);
+			}
+			if (lpid>=0) {
+				break;
+			}
+		}
+		/* 
+		 * If there are not enough free pages in the chunk, then we turn to 
+		 * the lowest one which has, so that the file stays dense. A run may
+		 * not be found in a chunk with room though, the ones after it are 
+		 * tried then */
 		close_curr_ck(db);
-		ck = find_ck(db, ck);
+		ck = find_ck(db, n==1 ? 0 : ck + 1, n);
 		/* TODO: reach the maximum length of the file, need to deal with it */
 		kvdb_assert(ck!=(ckid_t)-1);	
 		open_ck(db, ck);
 	}
 
-	/* Find a free page in the chunk */
-	for (lpid=PAGE_BITMAP_PAGES; lpid<PAGE_NUM_PER_CK; lpid++) {
-		gpid = get_gpid(ck, lpid);
-		if (!pb_isset(db, gpid))
+	return take_pages(db, (lpid_t)lpid, n);
+}
+
+gpid_t alloc_pages(kvdb_t db, uint32_t n)
+{
+	gpid_t gpid; 
+
+	pthread_mutex_lock(&db->alc->lock);
+	gpid = get_pages(db, n);
+	pthread_mutex_unlock(&db->alc->lock);
+	stat_add(db, STAT_PAGE_ALLOC, n);
+	return gpid;
+}
+
+gpid_t alloc_page(kvdb_t db)
+{
+	return alloc_pages(db, 1);
+}
+
+/* mark a page of any chunk free, alc->lock is held */
+static void clear_page(kvdb_t db, gpid_t gpid)
+{
+	struct allocator_s *alc = db->alc; 
+	ckid_t ck = (ckid_t)(gpid/PAGE_NUM_PER_CK);
+	lpid_t lpid = (lpid_t)(gpid%PAGE_NUM_PER_CK);
+	struct page_bitmap_s *pb;
+
+	if (ck==alc->curr_ck) {
+		kvdb_assert(pb_isset(alc->pb, lpid));
+		pb_clr(alc->pb, lpid);
+		sum_update(alc, lpid >> 6);
+		if ((lpid >> 6) < alc->hint) {
+			alc->hint = lpid >> 6;
+		}
+	} else {
+		pb = ck_pb(db, ck);
+		kvdb_assert(pb_isset(pb, lpid));
+		pb_clr(pb, lpid);
+	}
+	alc->bpn->n[ck] --;
+}
+
+void free_page(kvdb_t db, gpid_t gpid)
+{
+	pthread_mutex_lock(&db->alc->lock);
+	clear_page(db, gpid);
+	db->h->spare_pages ++;
+	pthread_mutex_unlock(&db->alc->lock);
+	unpin_page(db, gpid);
+	stat_add(db, STAT_PAGE_FREE, 1);
+}
+
+/*
+ * alloc_page_near() -- allocate a page close after hint, so that a page split
+ * in two gets its right half next to it on disk and leaves chained by h.next
+ * are mostly in order in the file: a scan reads on instead of seeking. 
+ *
+ * The last EXTENT_NUM pages handed out here are remembered. If one of them is
+ * split again, which is what appending to a range of keys does, EXTENT_PAGES
+ * in a row are set aside for it, and the pages split off the ones there go on
+ * taking the next of them. Other pages get a free page within NEAR_PAGES 
+ * after hint if there is one before the end of what is used, or else the
+ * first free one, so that random inserts keep the file dense. The pages left
+ * in an extent are given back when it is forgotten.
+ */
+gpid_t alloc_page_near(kvdb_t db, gpid_t hint)
+{
+	struct allocator_s *alc = db->alc; 
+	uint32_t lpid, end, w, i;
+	uint64_t x, used;
+	gpid_t gpid;
+
+	if (hint==GPID_NIL) {
+		return alloc_page(db);
+	}
+	pthread_mutex_lock(&alc->lock);
+	for (i=0; i<EXTENT_NUM; i++) {
+		if (hint==alc->ext[i].hint 
+			|| (hint>=alc->ext[i].start && hint<alc->ext[i].end)) {
 			break;
+		}
+	}
+	if (i<EXTENT_NUM) {
+		if (alc->ext[i].next==alc->ext[i].end) {
+			gpid = get_pages(db, EXTENT_PAGES);
+			alc->ext[i].hint = hint;
+			alc->ext[i].start = gpid;
+			alc->ext[i].end = gpid + EXTENT_PAGES;
+			alc->ext[i].next = gpid;
+		}
+		gpid = alc->ext[i].next++;
+		goto out;
 	}
-	kvdb_assert(lpid<PAGE_NUM_PER_CK);
 
-	pb_set(db, gpid);
-	alc->bpn->n[ck] ++; 
+	lpid = (uint32_t)(hint % PAGE_NUM_PER_CK) + 1;
+	end = lpid + NEAR_PAGES;
+	used = (db->h->used_size - get_ck_pos(hint / PAGE_NUM_PER_CK)) / PAGE_SIZE;
+	end = end<used ? end : (uint32_t)used;
+	end = end<PAGE_NUM_PER_CK ? end : PAGE_NUM_PER_CK;
+	gpid = GPID_NIL;
+	if (hint / PAGE_NUM_PER_CK==alc->curr_ck && lpid<end) {
+		w = lpid >> 6;
+		x = ~alc->pb->w[w] & (~0ULL << (lpid & 63));
+		while (x==0 && ++w<((end + 63) >> 6)) {
+			x = ~alc->pb->w[w];
+		}
+		lpid = (w << 6) + (x!=0 ? __builtin_ctzll(x) : 0);
+		if (x!=0 && lpid<end) {
+			gpid = take_pages(db, lpid, 1);
+		}
+	}
+	if (gpid==GPID_NIL) {
+		gpid = get_pages(db, 1);
+	}
 
-	pos = get_page_pos(gpid);
-	if (db->h->file_size < pos + PAGE_SIZE) {
-		file_allocate(db, pos, PAGE_SIZE);
+	i = alc->ext_hand;
+	alc->ext_hand = (i + 1) % EXTENT_NUM;
+	while (alc->ext[i].next<alc->ext[i].end) {
+		clear_page(db, alc->ext[i].next++);
 	}
+	alc->ext[i].hint = GPID_NIL;
+	alc->ext[i].start = gpid;
+	alc->ext[i].next = gpid + 1;
+	alc->ext[i].end = gpid + 1;
+out:
+	pthread_mutex_unlock(&alc->lock);
+	stat_add(db, STAT_PAGE_ALLOC, 1);
 	return gpid;
 }
 
-void free_page(kvdb_t db, gpid_t gpid)
+/* give back the pages of all extents set aside by alloc_page_near() */
+void release_extents(kvdb_t db)
+{
+	struct allocator_s *alc = db->alc; 
+	uint32_t i;
+
+	pthread_mutex_lock(&alc->lock);
+	for (i=0; i<EXTENT_NUM; i++) {
+		while (alc->ext[i].next<alc->ext[i].end) {
+			clear_page(db, alc->ext[i].next++);
+		}
+	}
+	pthread_mutex_unlock(&alc->lock);
+}
+
+/* the last chunk which could be in use */
+static ckid_t last_ck(kvdb_t db)
+{
+	uint64_t used = db->h->used_size;
+
+	if (used<=FILE_META_LEN) {
+		return 0;
+	}
+	return (ckid_t)((used - FILE_META_LEN - 1) / CHUNK_DATA_LEN);
+}
+
+/*
+ * clear_allocator() -- mark all pages free but the bitmaps, and forget the
+ * extents. After a crash the bitmaps may mark pages which are in no tree,
+ * the ones set aside in extents for one, the caller marks the pages of the
+ * tree used again with mark_page_used().
+ */
+void clear_allocator(kvdb_t db)
+{
+	struct allocator_s *alc = db->alc;
+	struct page_bitmap_s *pb;
+	ckid_t ck, last;
+	uint32_t i;
+
+	pthread_mutex_lock(&alc->lock);
+	close_curr_ck(db);
+	memset(alc->ext, 0, sizeof(alc->ext));
+	alc->ext_hand = 0;
+	last = last_ck(db);
+	for (ck=0; ck<=last; ck++) {
+		if (alc->bpn->n[ck]==0) {
+			continue;
+		}
+		pb = ck_pb(db, ck);
+		memset(pb, 0, PAGE_BITMAP_LEN);
+		for (i=0; i<PAGE_BITMAP_PAGES; i++) {
+			pb_set(pb, i);
+		}
+		alc->bpn->n[ck] = PAGE_BITMAP_PAGES;
+	}
+	open_ck(db, 0);
+	pthread_mutex_unlock(&alc->lock);
+}
+
+/* mark a page of any chunk used, see clear_allocator() */
+void mark_page_used(kvdb_t db, gpid_t gpid)
 {
+	struct allocator_s *alc = db->alc;
 	ckid_t ck = (ckid_t)(gpid/PAGE_NUM_PER_CK);
+	lpid_t lpid = (lpid_t)(gpid%PAGE_NUM_PER_CK);
+	struct page_bitmap_s *pb;
+	uint32_t i;
+
+	pthread_mutex_lock(&alc->lock);
+	if (ck==alc->curr_ck) {
+		kvdb_assert(!pb_isset(alc->pb, lpid));
+		pb_set(alc->pb, lpid);
+		sum_update(alc, lpid >> 6);
+	} else {
+		pb = ck_pb(db, ck);
+		if (alc->bpn->n[ck]==0) {
+			memset(pb, 0, PAGE_BITMAP_LEN);
+			for (i=0; i<PAGE_BITMAP_PAGES; i++) {
+				pb_set(pb, i);
+			}
+			alc->bpn->n[ck] = PAGE_BITMAP_PAGES;
+		}
+		kvdb_assert(!pb_isset(pb, lpid));
+		pb_set(pb, lpid);
+	}
+	alc->bpn->n[ck] ++;
+	pthread_mutex_unlock(&alc->lock);
+}
 
-	kvdb_assert(pb_isset(db, gpid));
-	pb_clr(db, gpid);
-	db->alc->bpn->n[ck] --;
-	db->h->spare_pages ++;
-	/* TODO: truncate those free pages at the tail of the database file */
-	/* TODO: Do we need to implement some GC things? */
+/* 
+ * used_pages() -- the pages handed out for the tree, not counting the bitmaps
+ * nor the pages still set aside in extents.
+ */
+uint64_t used_pages(kvdb_t db)
+{
+	struct allocator_s *alc = db->alc; 
+	uint64_t num = 0;
+	ckid_t ck, last;
+	uint32_t i;
+
+	pthread_mutex_lock(&alc->lock);
+	last = last_ck(db);
+	for (ck=0; ck<=last; ck++) {
+		if (alc->bpn->n[ck]>PAGE_BITMAP_PAGES) {
+			num += alc->bpn->n[ck] - PAGE_BITMAP_PAGES;
+		}
+	}
+	for (i=0; i<EXTENT_NUM; i++) {
+		num -= alc->ext[i].end - alc->ext[i].next;
+	}
+	pthread_mutex_unlock(&alc->lock);
+	return num;
+}
+
+/*
+ * Compaction moves the pages at the end of the file into the first free ones
+ * and cuts the file after the last page in use, see kvdb_compact(). These
+ * are called with d->lock held exclusively, nothing else allocates pages.
+ */
+
+/* the last page set in a bitmap before the page below, -1 if none */
+static int64_t last_set(struct page_bitmap_s *pb, uint32_t below)
+{
+	int64_t w;
+	uint64_t x;
+
+	if (below==0) {
+		return -1;
+	}
+	w = (below - 1) >> 6;
+	x = pb->w[w] & (~0ULL >> (63 - ((below - 1) & 63)));
+	while (x==0) {
+		if (--w<0) {
+			return -1;
+		}
+		x = pb->w[w];
+	}
+	return (w << 6) + 63 - __builtin_clzll(x);
+}
+
+/*
+ * last_used_page() -- the last page in use before the page below, or before
+ * the end of the file if below is GPID_NIL. The bitmaps of the chunks are 
+ * left out, they never move. Return GPID_NIL if there is no such page.
+ */
+gpid_t last_used_page(kvdb_t db, gpid_t below)
+{
+	struct allocator_s *alc = db->alc;
+	ckid_t ck = last_ck(db);
+	uint32_t end = PAGE_NUM_PER_CK;
+	gpid_t gpid = GPID_NIL;
+	int64_t lpid;
+
+	pthread_mutex_lock(&alc->lock);
+	if (below!=GPID_NIL && below/PAGE_NUM_PER_CK<=ck) {
+		ck = (ckid_t)(below / PAGE_NUM_PER_CK);
+		end = (uint32_t)(below % PAGE_NUM_PER_CK);
+	}
+	for (;; ck--, end=PAGE_NUM_PER_CK) {
+		if (alc->bpn->n[ck]>PAGE_BITMAP_PAGES) {
+			lpid = last_set(ck_pb(db, ck), end);
+			if (lpid>=(int64_t)PAGE_BITMAP_PAGES) {
+				gpid = get_gpid(ck, (lpid_t)lpid);
+				break;
+			}
+		}
+		if (ck==0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&alc->lock);
+	return gpid;
+}
+
+/*
+ * alloc_page_below() -- allocate the first free page of the file if it is 
+ * before the page limit, return GPID_NIL if it is not.
+ */
+gpid_t alloc_page_below(kvdb_t db, gpid_t limit)
+{
+	struct allocator_s *alc = db->alc;
+	gpid_t gpid = GPID_NIL;
+	lpid_t lpid;
+	uint32_t w;
+	ckid_t ck;
+
+	pthread_mutex_lock(&alc->lock);
+	ck = find_ck(db, 0, 1);
+	if (ck==(ckid_t)-1 || alc->bpn->n[ck]==0 
+			|| get_gpid(ck, PAGE_BITMAP_PAGES)>=limit) {
+		goto out;
+	}
+	if (ck!=alc->curr_ck) {
+		close_curr_ck(db);
+		open_ck(db, ck);
+	}
+	w = find_free_word(alc);
+	lpid = (w << 6) + __builtin_ctzll(~alc->pb->w[w]);
+	alc->hint = w;
+	if (get_gpid(ck, lpid)>=limit) {
+		goto out;
+	}
+	gpid = take_pages(db, lpid, 1);
+	stat_add(db, STAT_PAGE_ALLOC, 1);
+out:
+	pthread_mutex_unlock(&alc->lock);
+	return gpid;
+}
+
+/*
+ * file_end_page() -- the page after the last one in use. Chunks at the end
+ * which only hold their bitmaps are given up on the way, open_ck() sets them
+ * up again if they are needed later.
+ */
+gpid_t file_end_page(kvdb_t db)
+{
+	struct allocator_s *alc = db->alc;
+	gpid_t gpid = get_gpid(0, PAGE_BITMAP_PAGES);
+	int64_t lpid;
+	ckid_t ck;
+	int ret;
+
+	pthread_mutex_lock(&alc->lock);
+	for (ck=last_ck(db); ; ck--) {
+		if (alc->bpn->n[ck]==PAGE_BITMAP_PAGES && ck>0 && ck!=alc->curr_ck) {
+			alc->bpn->n[ck] = 0;
+			if (alc->other_pb!=NULL && alc->other_ck==ck) {
+				ret = munmap(alc->other_pb, PAGE_BITMAP_LEN);
+				kvdb_assert(ret==0);
+				alc->other_pb = NULL;
+			}
+		} else if (alc->bpn->n[ck]>0) {
+			lpid = last_set(ck_pb(db, ck), PAGE_NUM_PER_CK);
+			gpid = get_gpid(ck, (lpid_t)(lpid + 1));
+			break;
+		}
+		if (ck==0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&alc->lock);
+	return gpid;
+}
+
+/* cut_file() -- cut the file at the page end, no page from there is in use */
+void cut_file(kvdb_t db, gpid_t end)
+{
+	struct file_header_s *h = db->h;
+	uint64_t size = get_page_pos(end);
+	int ret;
+
+	pthread_mutex_lock(&db->alc->lock);
+	if (size<h->file_size) {
+		ret = ftruncate(db->fd, size);
+		kvdb_assert(ret==0);
+		h->file_size = size;
+	}
+	if (size<h->used_size) {
+		h->used_size = size;
+	}
+	pthread_mutex_unlock(&db->alc->lock);
+}
+
+/*
+ * punch_free_pages() -- give the blocks of runs of HOLE_MIN_PAGES free pages
+ * or more back to the file system. Such pages read as zeroes and get blocks
+ * again when they are written, which is when a full file system shows up 
+ * for them, unlike for the pages file_allocate() has reserved. Nothing is
+ * done if the file system could not punch holes.
+ *
+ * Return the number of pages punched, some of them may have been before.
+ */
+uint64_t punch_free_pages(kvdb_t db)
+{
+	struct allocator_s *alc = db->alc;
+	struct page_bitmap_s *pb;
+	uint32_t lpid, start, end;
+	uint64_t num = 0, ck_end;
+	ckid_t ck, last;
+	int ret;
+
+	pthread_mutex_lock(&alc->lock);
+	last = last_ck(db);
+	for (ck=0; ck<=last; ck++) {
+		if (alc->bpn->n[ck]==0) {
+			continue;
+		}
+		pb = ck_pb(db, ck);
+		ck_end = (db->h->file_size - get_ck_pos(ck)) / PAGE_SIZE;
+		end = ck_end<PAGE_NUM_PER_CK ? (uint32_t)ck_end : PAGE_NUM_PER_CK;
+		lpid = PAGE_BITMAP_PAGES;
+		while (lpid<end) {
+			if (pb->w[lpid >> 6]==~0ULL) {
+				lpid = (lpid | 63) + 1;
+				continue;
+			}
+			if (pb_isset(pb, lpid)) {
+				lpid ++;
+				continue;
+			}
+			start = lpid;
+			while (lpid<end && !pb_isset(pb, lpid)) {
+				lpid += ((lpid & 63)==0 && pb->w[lpid >> 6]==0) ? 64 : 1;
+			}
+			lpid = lpid<end ? lpid : end;
+			if (lpid - start<HOLE_MIN_PAGES) {
+				continue;
+			}
+			ret = fallocate(db->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 
+					get_page_pos(get_gpid(ck, start)), 
+					(uint64_t)(lpid - start) * PAGE_SIZE);
+			if (ret!=0 && errno==EOPNOTSUPP) {
+				goto out;
+			}
+			kvdb_assert(ret==0);
+			stat_add(db, STAT_FALLOCATE, 1);
+			stat_add(db, STAT_FALLOCATE_BYTES, (uint64_t)(lpid - start) * PAGE_SIZE);
+			num += lpid - start;
+		}
+	}
+out:
+	pthread_mutex_unlock(&alc->lock);
+	return num;
 }
 
 void sync_allocator(kvdb_t db)
 {
 	int ret;
 
+	pthread_mutex_lock(&db->alc->lock);
 	if (db->alc->pb!=NULL) {
 		ret = msync(db->alc->pb, PAGE_BITMAP_LEN, MS_SYNC);
 		kvdb_assert(ret==0); 
 	}
+	if (db->alc->other_pb!=NULL) {
+		ret = msync(db->alc->other_pb, PAGE_BITMAP_LEN, MS_SYNC);
+		kvdb_assert(ret==0); 
+	}
 
 	kvdb_assert(db->alc->bpn!=NULL);
 	ret = msync(db->alc->bpn, sizeof (struct busy_page_num_s), MS_SYNC);
 	kvdb_assert(ret==0); 
-
+	stat_add(db, STAT_MSYNC, 1 + (db->alc->pb!=NULL) + (db->alc->other_pb!=NULL));
+	stat_add(db, STAT_MSYNC_BYTES, sizeof (struct busy_page_num_s) 
+			+ PAGE_BITMAP_LEN * ((db->alc->pb!=NULL) + (db->alc->other_pb!=NULL)));
+	pthread_mutex_unlock(&db->alc->lock);
 }
 
 void exit_allocator(kvdb_t db)
 {
 	int ret;
 
+	release_extents(db);
 	sync_allocator(db);
 
 	if (db->alc->pb!=NULL) {
@@ -229,14 +846,53 @@ void exit_allocator(kvdb_t db)
 		db->alc->curr_ck = (ckid_t)-1;
 		db->alc->pb = NULL;
 	}
+	if (db->alc->other_pb!=NULL) {
+		ret = munmap(db->alc->other_pb, PAGE_BITMAP_LEN);
+		kvdb_assert(ret==0); 
+		db->alc->other_pb = NULL;
+	}
 
 	ret = munmap(db->alc->bpn, sizeof (struct busy_page_num_s));
 	kvdb_assert(ret==0); 
 	db->alc->bpn = NULL;
+	pthread_mutex_destroy(&db->alc->lock);
 	free(db->alc);
 	db->alc = NULL;
 }
 
+/*
+ * check_used_size() -- raise used_size to the end of the last page the
+ * bitmaps mark in use. A version which did not keep used_size may have
+ * handed out pages after the one it was left at, which compaction would
+ * otherwise cut off with the file.
+ */
+static void check_used_size(kvdb_t db)
+{
+	struct allocator_s *alc = db->alc;
+	struct file_header_s *h = db->h;
+	uint64_t end;
+	int64_t lpid;
+	ckid_t ck;
+
+	if (h->file_size<=FILE_META_LEN) {
+		return;
+	}
+	for (ck=(ckid_t)((h->file_size - FILE_META_LEN - 1) / CHUNK_DATA_LEN); ; ck--) {
+		if (alc->bpn->n[ck]>0) {
+			lpid = last_set(ck_pb(db, ck), PAGE_NUM_PER_CK);
+			end = get_page_pos(get_gpid(ck, (lpid_t)(lpid + 1)));
+			end = end<h->file_size ? end : h->file_size;
+			if (h->used_size<end) {
+				h->used_size = end;
+			}
+			return;
+		}
+		if (ck==0) {
+			return;
+		}
+	}
+}
+
 void init_allocator(kvdb_t db)
 {
 	struct allocator_s *alc; 
@@ -246,6 +902,7 @@ void init_allocator(kvdb_t db)
 	alc = (struct allocator_s *)malloc(sizeof(*alc));
 	kvdb_assert(alc!=NULL);
 	memset(alc, 0, sizeof(*alc));
+	pthread_mutex_init(&alc->lock, NULL);
 	db->alc = alc;
 	alc->curr_ck = (ckid_t)-1;
 	
@@ -253,7 +910,7 @@ void init_allocator(kvdb_t db)
 	 * if the file size smaller than the area of busy page number, the file is
 	 * a new one, so it is needed to be expanded.
 	 */
-	if (db->h->file_size < BUSY_PAGE_NUM_POS + sizeof(struct busy_page_num_s)) {
+	if (db->h->used_size < BUSY_PAGE_NUM_POS + sizeof(struct busy_page_num_s)) {
 		file_allocate(db, BUSY_PAGE_NUM_POS, sizeof(struct busy_page_num_s));
 		new = 1;
 	}
@@ -265,8 +922,10 @@ void init_allocator(kvdb_t db)
 
 	if (new)
 		memset(alc->bpn, 0, sizeof(struct busy_page_num_s));
+	else
+		check_used_size(db);
 
-	ck = find_ck(db, 0);
+	ck = find_ck(db, 0, 1);
 	kvdb_assert(ck!=(ckid_t)-1);
 
 	open_ck(db, ck);
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "kvdb.h"
+
+/*
+ * kvbench -- run YCSB style workloads against a database and print the
+ * throughput and latency percentiles as one JSON object, so that runs of
+ * different versions can be compared by a script.
+ *
+ * records are loaded with kvdb_bulk_load() first, record i has key i, or a
+ * hash of i with -H so that neighbours in the key space are not neighbours
+ * in the load order. Every thread then runs the warm-up operations, which
+ * are not counted, and its share of the measured ones. Each operation is
+ * timed with CLOCK_MONOTONIC into a log-linear histogram of its kind.
+ */
+
+#define OP_READ		0
+#define OP_UPDATE	1
+#define OP_INSERT	2
+#define OP_SCAN		3
+#define OP_RMW		4	// read, modify and write back
+#define OP_NUM		5
+
+#define DIST_UNIFORM	0
+#define DIST_ZIPFIAN	1
+#define DIST_SEQUENTIAL	2
+#define DIST_LATEST	3	// zipfian from the last record inserted back
+
+#define VAL_KEY		0	// the value is the key
+#define VAL_RANDOM	1
+#define VAL_ZERO	2
+#define VAL_COUNTER	3	// how many times the thread has written
+
+#define ZIPF_THETA	0.99
+
+/* histogram buckets: exact below 16, then 16 per power of two */
+#define HIST_SUB	16
+#define HIST_NUM	(HIST_SUB + 60*HIST_SUB)
+
+static const char *op_names[OP_NUM] = {"read", "update", "insert", "scan", "rmw"};
+static const char *dist_names[] = {"uniform", "zipfian", "sequential", "latest"};
+static const char *val_names[] = {"key", "random", "zero", "counter"};
+static const char *cache_names[] = {"page", "area", "direct"};
+
+struct mix_s {
+	char *name;
+	int pct[OP_NUM];		// percent of each operation
+	int dist;
+};
+
+static struct mix_s mixes[] = {
+	{"a", {50, 50, 0, 0, 0}, DIST_ZIPFIAN},		// update heavy
+	{"b", {95, 5, 0, 0, 0}, DIST_ZIPFIAN},		// read mostly
+	{"c", {100, 0, 0, 0, 0}, DIST_ZIPFIAN},		// read only
+	{"d", {95, 0, 5, 0, 0}, DIST_LATEST},		// read latest
+	{"e", {0, 0, 5, 95, 0}, DIST_ZIPFIAN},		// short ranges
+	{"f", {50, 0, 0, 0, 50}, DIST_ZIPFIAN},		// read-modify-write
+	{NULL, {0}, 0},
+};
+
+struct zipf_s {
+	uint64_t n;
+	double theta, alpha, zetan, eta;
+};
+
+struct hist_s {
+	uint64_t num;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t b[HIST_NUM];
+};
+
+struct worker_s {
+	pthread_t tid;
+	int id;
+	uint64_t rnd;
+	uint64_t seq;			// DIST_SEQUENTIAL: the next record
+	uint64_t writes;
+	uint64_t found;
+	uint64_t scanned;		// records returned by scans
+	struct hist_s h[OP_NUM];
+};
+
+/* options */
+static char *db_name = "bench.db";
+static struct mix_s *mix;
+static int dist = -1;
+static int val_pat = VAL_KEY;
+static int hashed;
+static int threads = 1;
+static uint64_t records = 1000000;
+static uint64_t ops = 1000000;
+static uint64_t warmup = 100000;
+static int scan_max = 100;
+static uint64_t cache_size;
+static uint32_t cache_mode;
+
+static kvdb_t db;
+static struct zipf_s zipf;
+static uint64_t inserted;		// records loaded or inserted so far
+static pthread_barrier_t barrier;
+static struct timespec t_start, t_end;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t next_rnd(struct worker_s *w)
+{
+	w->rnd ^= w->rnd >> 12;
+	w->rnd ^= w->rnd << 25;
+	w->rnd ^= w->rnd >> 27;
+	return w->rnd * 0x2545f4914f6cdd1dULL;
+}
+
+static double rnd_01(struct worker_s *w)
+{
+	return (next_rnd(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* a bijection of 64-bit integers, spreads consecutive numbers apart */
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint64_t rec_key(uint64_t i)
+{
+	return hashed ? mix64(i) : i;
+}
+
+static uint64_t rec_val(struct worker_s *w, uint64_t k)
+{
+	switch (val_pat) {
+	case VAL_RANDOM:
+		return next_rnd(w);
+	case VAL_ZERO:
+		return 0;
+	case VAL_COUNTER:
+		return ++w->writes;
+	}
+	return k;
+}
+
+/* the zipfian generator of Gray et al., "Quickly generating billion-record synthetic databases" */
+static void init_zipf(struct zipf_s *z, uint64_t n, double theta)
+{
+	double zeta2 = 1.0 + pow(0.5, theta);
+	uint64_t i;
+
+	z->n = n;
+	z->theta = theta;
+	z->zetan = 0;
+	for (i=1; i<=n; i++) {
+		z->zetan += 1.0 / pow((double)i, theta);
+	}
+	z->alpha = 1.0 / (1.0 - theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+/* a rank from 0 on, 0 is the most popular one */
+static uint64_t next_zipf(struct worker_s *w, struct zipf_s *z)
+{
+	double u = rnd_01(w), uz = u * z->zetan;
+	uint64_t r;
+
+	if (uz<1.0)
+		return 0;
+	if (uz<1.0 + pow(0.5, z->theta))
+		return 1;
+	r = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return r<z->n ? r : z->n - 1;
+}
+
+/* the record an operation on an existing record goes to */
+static uint64_t next_rec(struct worker_s *w)
+{
+	uint64_t n = __atomic_load_n(&inserted, __ATOMIC_RELAXED);
+	uint64_t r;
+
+	switch (dist) {
+	case DIST_ZIPFIAN:
+		/* scrambled, so that the popular records are not all in a few leaves */
+		return mix64(next_zipf(w, &zipf)) % n;
+	case DIST_SEQUENTIAL:
+		r = w->seq++ % n;
+		return r;
+	case DIST_LATEST:
+		r = next_zipf(w, &zipf);
+		return r<n ? n - 1 - r : 0;
+	}
+	return next_rnd(w) % n;
+}
+
+static int pick_op(struct worker_s *w)
+{
+	int x = (int)(next_rnd(w) % 100), i;
+
+	for (i=0; i<OP_NUM-1; i++) {
+		if (x<mix->pct[i])
+			return i;
+		x -= mix->pct[i];
+	}
+	return OP_NUM-1;
+}
+
+static void hist_add(struct hist_s *h, uint64_t v)
+{
+	int e, i;
+
+	if (v<HIST_SUB) {
+		i = (int)v;
+	} else {
+		e = 63 - __builtin_clzll(v);	// at least 4
+		i = HIST_SUB + (e - 4) * HIST_SUB + (int)((v >> (e - 4)) & (HIST_SUB - 1));
+	}
+	h->b[i] ++;
+	h->num ++;
+	h->sum += v;
+	h->max = v>h->max ? v : h->max;
+}
+
+/* the largest value which falls in bucket i */
+static uint64_t hist_top(int i)
+{
+	int e;
+
+	if (i<HIST_SUB)
+		return i;
+	e = (i - HIST_SUB) / HIST_SUB + 4;
+	return ((uint64_t)(HIST_SUB + (i - HIST_SUB) % HIST_SUB + 1) << (e - 4)) - 1;
+}
+
+static uint64_t hist_pct(struct hist_s *h, double p)
+{
+	uint64_t sum = 0, want = (uint64_t)ceil(p * h->num);
+	int i;
+
+	for (i=0; i<HIST_NUM; i++) {
+		sum += h->b[i];
+		if (sum>=want && sum>0)
+			return hist_top(i)<h->max ? hist_top(i) : h->max;
+	}
+	return h->max;
+}
+
+static void do_op(struct worker_s *w, int op)
+{
+	uint64_t i, k, v;
+	cursor_t cs;
+	int n, len;
+
+	switch (op) {
+	case OP_READ:
+		k = rec_key(next_rec(w));
+		w->found += (kvdb_get(db, k, &v)==0);
+		break;
+	case OP_UPDATE:
+		k = rec_key(next_rec(w));
+		kvdb_put(db, k, rec_val(w, k));
+		break;
+	case OP_INSERT:
+		i = __atomic_fetch_add(&inserted, 1, __ATOMIC_RELAXED);
+		k = rec_key(i);
+		kvdb_put(db, k, rec_val(w, k));
+		break;
+	case OP_SCAN:
+		k = rec_key(next_rec(w));
+		len = 1 + (int)(next_rnd(w) % scan_max);
+		cs = kvdb_open_cursor(db, k, (uint64_t)-1);
+		for (n=0; n<len && kvdb_get_next(db, cs, &k, &v)==0; n++)
+			;
+		kvdb_close_cursor(db, cs);
+		w->scanned += n;
+		break;
+	case OP_RMW:
+		k = rec_key(next_rec(w));
+		if (kvdb_get(db, k, &v)==0) {
+			w->found ++;
+		} else {
+			v = 0;
+		}
+		kvdb_put(db, k, v + 1);
+		break;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker_s *w = (struct worker_s *)arg;
+	uint64_t i, n, t;
+	int op;
+
+	n = warmup / threads + (w->id < (int)(warmup % threads));
+	for (i=0; i<n; i++) {
+		do_op(w, pick_op(w));
+	}
+	w->found = w->scanned = 0;
+
+	pthread_barrier_wait(&barrier);
+	if (w->id==0) {
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+	}
+	n = ops / threads + (w->id < (int)(ops % threads));
+	for (i=0; i<n; i++) {
+		op = pick_op(w);
+		t = now_ns();
+		do_op(w, op);
+		hist_add(&w->h[op], now_ns() - t);
+	}
+	pthread_barrier_wait(&barrier);
+	if (w->id==0) {
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+	}
+	return NULL;
+}
+
+struct load_s {
+	uint64_t i;
+	struct worker_s w;
+};
+
+static int next_load(void *arg, uint64_t *k, uint64_t *v)
+{
+	struct load_s *l = (struct load_s *)arg;
+
+	if (l->i>=records)
+		return -1;
+	*k = rec_key(l->i++);
+	*v = rec_val(&l->w, *k);
+	return 0;
+}
+
+static void print_hist(const char *name, struct hist_s *h, double sec, int last)
+{
+	printf("    \"%s\": {\"count\": %lu, \"ops_per_sec\": %.0f, \"mean_ns\": %lu, "
+		"\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}%s\n",
+		name, h->num, h->num / sec, h->num ? h->sum / h->num : 0,
+		hist_pct(h, 0.5), hist_pct(h, 0.99), hist_pct(h, 0.999), h->max,
+		last ? "" : ",");
+}
+
+static void print_report(struct worker_s *w, double load_sec)
+{
+	struct kvdb_stats_s st;
+	struct hist_s all, sum[OP_NUM];
+	uint64_t found = 0, scanned = 0;
+	double sec;
+	int i, j, t, n;
+
+	memset(&all, 0, sizeof(all));
+	memset(sum, 0, sizeof(sum));
+	for (t=0; t<threads; t++) {
+		found += w[t].found;
+		scanned += w[t].scanned;
+		for (i=0; i<OP_NUM; i++) {
+			for (j=0; j<HIST_NUM; j++) {
+				sum[i].b[j] += w[t].h[i].b[j];
+				all.b[j] += w[t].h[i].b[j];
+			}
+			sum[i].num += w[t].h[i].num;
+			sum[i].sum += w[t].h[i].sum;
+			sum[i].max = w[t].h[i].max>sum[i].max ? w[t].h[i].max : sum[i].max;
+		}
+	}
+	for (i=0; i<OP_NUM; i++) {
+		all.num += sum[i].num;
+		all.sum += sum[i].sum;
+		all.max = sum[i].max>all.max ? sum[i].max : all.max;
+	}
+	sec = (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+	kvdb_get_stats(db, &st);
+
+	printf("{\n");
+	printf("  \"workload\": \"%s\", \"dist\": \"%s\", \"values\": \"%s\", \"hashed\": %d,\n",
+		mix->name, dist_names[dist], val_names[val_pat], hashed);
+	printf("  \"threads\": %d, \"records\": %lu, \"warmup\": %lu, \"ops\": %lu,\n",
+		threads, records, warmup, ops);
+	printf("  \"load_sec\": %.3f, \"run_sec\": %.3f, \"ops_per_sec\": %.0f,\n",
+		load_sec, sec, all.num / sec);
+	printf("  \"found\": %lu, \"scanned\": %lu,\n", found, scanned);
+	printf("  \"latency\": {\n");
+	for (i=0, n=0; i<OP_NUM; i++) {
+		n += (sum[i].num>0);
+	}
+	print_hist("all", &all, sec, n==0);
+	for (i=0; i<OP_NUM; i++) {
+		if (sum[i].num>0) {
+			print_hist(op_names[i], &sum[i], sec, --n==0);
+		}
+	}
+	printf("  },\n");
+	printf("  \"engine\": {\"records\": %lu, \"height\": %lu, \"pages\": %lu, "
+		"\"fill_pct\": %u, \"file_size\": %lu,\n",
+		st.records, st.height, st.pages, st.fill_pct, st.file_size);
+	printf("    \"cache_hits\": %lu, \"cache_misses\": %lu, \"cache_evictions\": %lu, "
+		"\"cache_writebacks\": %lu,\n",
+		st.cache_hits, st.cache_misses, st.cache_evictions, st.cache_writebacks);
+	printf("    \"msync_calls\": %lu, \"fsync_calls\": %lu, \"fallocate_calls\": %lu, "
+		"\"pwrite_calls\": %lu, \"pread_calls\": %lu, \"log_bytes\": %lu,\n",
+		st.msync_calls, st.fsync_calls, st.fallocate_calls, st.pwrite_calls,
+		st.pread_calls, st.log_bytes);
+	printf("    \"splits\": %lu, \"merges\": %lu, \"page_allocs\": %lu, \"page_frees\": %lu}\n",
+		st.splits, st.merges, st.page_allocs, st.page_frees);
+	printf("}\n");
+}
+
+static int find_name(const char **names, int n, const char *s)
+{
+	int i;
+
+	for (i=0; i<n; i++) {
+		if (strcmp(names[i], s)==0)
+			return i;
+	}
+	fprintf(stderr, "unknown name %s\n", s);
+	exit(1);
+}
+
+static void usage(void)
+{
+	printf(
+		"usage: kvbench [options]\n"\
+		"    -w <a-f>      YCSB workload, default a\n"\
+		"    -d <dist>     uniform, zipfian, sequential or latest, default of the workload\n"\
+		"    -v <values>   key, random, zero or counter, default key\n"\
+		"    -n <num>      records loaded, default 1000000\n"\
+		"    -o <num>      operations measured, default 1000000\n"\
+		"    -W <num>      operations of warm-up, default 100000\n"\
+		"    -t <num>      threads, default 1\n"\
+		"    -l <num>      longest scan, default 100\n"\
+		"    -c <bytes>    cache size, default of kvdb_open()\n"\
+		"    -m <mode>     page, area or direct cache, default of kvdb_open()\n"\
+		"    -H            hash the keys instead of numbering them\n"\
+		"    -f <file>     database file, removed first, default bench.db\n"\
+		);
+}
+
+int main(int argc, char *argv[])
+{
+	struct kvdb_opts_s opts;
+	struct worker_s *w;
+	struct load_s load;
+	char log_name[1024];
+	uint64_t t;
+	int c, i;
+
+	mix = &mixes[0];
+	while ((c = getopt(argc, argv, "w:d:v:n:o:W:t:l:c:m:Hf:h"))!=-1) {
+		switch (c) {
+		case 'w':
+			for (mix=mixes; mix->name!=NULL && strcmp(mix->name, optarg)!=0; mix++)
+				;
+			if (mix->name==NULL) {
+				fprintf(stderr, "unknown workload %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			dist = find_name(dist_names, 4, optarg);
+			break;
+		case 'v':
+			val_pat = find_name(val_names, 4, optarg);
+			break;
+		case 'n':
+			records = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'W':
+			warmup = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'l':
+			scan_max = atoi(optarg);
+			break;
+		case 'c':
+			cache_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			cache_mode = find_name(cache_names, 3, optarg) + 1;
+			break;
+		case 'H':
+			hashed = 1;
+			break;
+		case 'f':
+			db_name = optarg;
+			break;
+		default:
+			usage();
+			return c=='h' ? 0 : 1;
+		}
+	}
+	if (records==0 || threads<1 || scan_max<1) {
+		usage();
+		return 1;
+	}
+	if (dist<0) {
+		dist = mix->dist;
+	}
+	init_zipf(&zipf, records, ZIPF_THETA);
+
+	snprintf(log_name, sizeof(log_name), "%s.log", db_name);
+	unlink(db_name);
+	unlink(log_name);
+	memset(&opts, 0, sizeof(opts));
+	opts.cache_size = cache_size;
+	opts.cache_mode = cache_mode;
+	db = kvdb_open_ex(db_name, &opts);
+
+	memset(&load, 0, sizeof(load));
+	load.w.rnd = 0x9e3779b97f4a7c15ULL;
+	t = now_ns();
+	kvdb_bulk_load(db, next_load, &load, 0);
+	t = now_ns() - t;
+	inserted = records;
+
+	w = (struct worker_s *)calloc(threads, sizeof(*w));
+	pthread_barrier_init(&barrier, NULL, threads);
+	for (i=0; i<threads; i++) {
+		w[i].id = i;
+		w[i].rnd = mix64(i + 1);
+		w[i].seq = records / threads * i;
+		pthread_create(&w[i].tid, NULL, worker_main, &w[i]);
+	}
+	for (i=0; i<threads; i++) {
+		pthread_join(w[i].tid, NULL);
+	}
+	print_report(w, t / 1e9);
+
+	pthread_barrier_destroy(&barrier);
+	free(w);
+	kvdb_close(db);
+	return 0;
+}
@@ -0,0 +1,320 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "inner.h"
+
+/*
+ * Branch pages come in two encodings. A wide one is a struct page_s like a
+ * leaf, with 64-bit keys and child gpids. A compact one (PAGE_COMPACT) is a
+ * struct branch_s: keys are stored as 32-bit deltas from the first one,
+ * shifted right by the trailing zero bits all of them have in common, and
+ * child gpids in 32 bits, which about doubles the fanout. Leaf splits pick
+ * separators with as many trailing zero bits as they could, see bpt_split(),
+ * so that even random keys usually fit.
+ *
+ * A page is re-encoded when a record does not fit the encoding it has, in
+ * the compact one whenever possible. This fails only for a compact page
+ * which holds more records than a wide one could, the caller must split it
+ * then. The functions here never mark a page dirty, the callers do.
+ */
+
+#define FIND_WINDOW	32	// deltas br_find() counts with a vector kernel
+
+static uint32_t br_capacity(struct page_s *p)
+{
+	return (p->h.flags & PAGE_COMPACT) ? BRANCH_NUM_PG : RECORD_NUM_PG;
+}
+
+/* whether a record could be inserted without re-encoding the page */
+int br_room(struct page_s *p)
+{
+	return (uint32_t)p->h.record_num < br_capacity(p);
+}
+
+/*
+ * br_sep() -- the key in (lo, hi] with the most trailing zero bits, any key
+ * there separates two leaves and short ones keep branch pages compact.
+ */
+uint64_t br_sep(uint64_t lo, uint64_t hi)
+{
+	int b;
+
+	b = 63 - __builtin_clzll(lo ^ hi);
+	return hi & ~((1ULL << b) - 1);
+}
+
+/* like find_key() */
+int br_find(struct page_s *p, uint64_t k)
+{
+	struct branch_s *b = (struct branch_s *)p;
+	uint64_t d;
+	int lo, n, half;
+
+	if (k < b->base) {
+		return -1;
+	}
+	/* k >= base + (dk << shift) exactly when (k - base) >> shift >= dk */
+	d = (k - b->base) >> (b->shift & 63);
+	if (d > UINT32_MAX) {
+		d = UINT32_MAX;
+	}
+	lo = 0;
+	n = b->h.record_num;
+	if ((uint32_t)n > BRANCH_NUM_PG) {
+		n = BRANCH_NUM_PG;	// torn under an optimistic reader
+	}
+	while (n > FIND_WINDOW) {
+		half = n / 2;
+		lo = (b->dk[lo+half-1] <= (uint32_t)d) ? lo + half : lo;
+		n -= half;
+	}
+	return lo + count_keys32_le(&b->dk[lo], n, (uint32_t)d) - 1;
+}
+
+static void br_decode(struct page_s *p, uint64_t *k, gpid_t *c)
+{
+	int i;
+
+	for (i=0; i<p->h.record_num; i++) {
+		k[i] = br_key(p, i);
+		c[i] = br_child(p, i);
+	}
+}
+
+/* write n records into a page, compact if they fit, return -1 if not at all */
+static int br_encode(struct page_s *p, const uint64_t *k, const gpid_t *c, int n)
+{
+	struct branch_s *b = (struct branch_s *)p;
+	uint64_t bits = 0;
+	uint32_t shift = 0;
+	int i, compact = (n <= (int)BRANCH_NUM_PG);
+
+	for (i=0; i<n && compact; i++) {
+		bits |= k[i] - k[0];
+		compact = (c[i] <= UINT32_MAX);
+	}
+	if (bits!=0) {
+		shift = __builtin_ctzll(bits);
+	}
+	if (compact && n>0 && ((k[n-1] - k[0]) >> shift) <= UINT32_MAX) {
+		b->base = k[0];
+		b->shift = shift;
+		b->reserve = 0;
+		for (i=0; i<n; i++) {
+			b->dk[i] = (uint32_t)((k[i] - k[0]) >> shift);
+			b->c[i] = (uint32_t)c[i];
+		}
+		b->h.flags |= PAGE_COMPACT;
+	} else if (n <= (int)RECORD_NUM_PG) {
+		memmove(p->k, k, n * sizeof(uint64_t));
+		memmove(p->v, c, n * sizeof(uint64_t));
+		p->h.flags &= ~PAGE_COMPACT;
+	} else {
+		return -1;
+	}
+	p->h.record_num = n;
+	return 0;
+}
+
+/* make a branch page holding one record, the new root of a tree */
+void br_init(struct page_s *p, uint64_t k, gpid_t child)
+{
+	p->h.flags = PAGE_KV;
+	p->h.next = GPID_NIL;
+	br_encode(p, &k, &child, 1);
+}
+
+/* re-encode a wide page compact, return 0 if it is compact then */
+int br_compact(struct page_s *p)
+{
+	uint64_t k[RECORD_NUM_PG];
+	gpid_t c[RECORD_NUM_PG];
+
+	if ((p->h.flags & PAGE_COMPACT)==0) {
+		br_decode(p, k, c);
+		br_encode(p, k, c, p->h.record_num);
+	}
+	return (p->h.flags & PAGE_COMPACT) ? 0 : -1;
+}
+
+/* whether (k, child) could be stored in the page as it is encoded now */
+static int br_fits(struct page_s *p, uint64_t k, gpid_t child)
+{
+	struct branch_s *b = (struct branch_s *)p;
+	uint64_t d;
+
+	if (!br_room(p)) {
+		return 0;
+	}
+	if ((p->h.flags & PAGE_COMPACT)==0) {
+		return 1;
+	}
+	if (k < b->base || child > UINT32_MAX) {
+		return 0;
+	}
+	d = k - b->base;
+	return (d & ((1ULL << b->shift) - 1))==0 && (d >> b->shift) <= UINT32_MAX;
+}
+
+/*
+ * br_insert() -- insert the record (k, child) after the pos-th one. If k is
+ * less than the first key, which happens when the first child is split, the
+ * first key is lowered to low ahead of it, see bpt_split().
+ *
+ * return 0 if success, -1 if the page must be split first, it is not changed
+ */
+int br_insert(struct page_s *p, int pos, uint64_t k, gpid_t child, uint64_t low)
+{
+	struct branch_s *b = (struct branch_s *)p;
+	uint64_t keys[BRANCH_NUM_PG+1];
+	gpid_t c[BRANCH_NUM_PG+1];
+	int n = p->h.record_num;
+
+	kvdb_assert(pos>=0 && pos<n);
+	if (pos>0 || k>br_key(p, 0)) {
+		kvdb_assert(k > br_key(p, pos) && (pos==n-1 || k < br_key(p, pos+1)));
+		if (br_fits(p, k, child)) {
+			if (p->h.flags & PAGE_COMPACT) {
+				memmove(&b->dk[pos+2], &b->dk[pos+1], (n-pos-1) * sizeof(uint32_t));
+				memmove(&b->c[pos+2], &b->c[pos+1], (n-pos-1) * sizeof(uint32_t));
+				b->dk[pos+1] = (uint32_t)((k - b->base) >> b->shift);
+				b->c[pos+1] = (uint32_t)child;
+			} else {
+				memmove(&p->k[pos+2], &p->k[pos+1], (n-pos-1) * sizeof(uint64_t));
+				memmove(&p->v[pos+2], &p->v[pos+1], (n-pos-1) * sizeof(uint64_t));
+				p->k[pos+1] = k;
+				p->v[pos+1] = child;
+			}
+			p->h.record_num ++;
+			return 0;
+		}
+	}
+
+	br_decode(p, keys, c);
+	if (pos==0 && k<=keys[0]) {
+		kvdb_assert(low < k);
+		keys[0] = low;
+	}
+	memmove(&keys[pos+2], &keys[pos+1], (n-pos-1) * sizeof(uint64_t));
+	memmove(&c[pos+2], &c[pos+1], (n-pos-1) * sizeof(gpid_t));
+	keys[pos+1] = k;
+	c[pos+1] = child;
+	return br_encode(p, keys, c, n+1);
+}
+
+/* delete the pos-th record, the keys left fit the encoding as they did */
+void br_delete(struct page_s *p, int pos)
+{
+	struct branch_s *b = (struct branch_s *)p;
+	int n = p->h.record_num;
+
+	if (p->h.flags & PAGE_COMPACT) {
+		memmove(&b->dk[pos], &b->dk[pos+1], (n-pos-1) * sizeof(uint32_t));
+		memmove(&b->c[pos], &b->c[pos+1], (n-pos-1) * sizeof(uint32_t));
+	} else {
+		memmove(&p->k[pos], &p->k[pos+1], (n-pos-1) * sizeof(uint64_t));
+		memmove(&p->v[pos], &p->v[pos+1], (n-pos-1) * sizeof(uint64_t));
+	}
+	p->h.record_num --;
+}
+
+/*
+ * br_set_key() -- replace the key of the pos-th record, pos > 0, by k, which
+ * must stay between the keys around it. Return -1 if the keys would not fit
+ * the page, it is not changed then.
+ */
+int br_set_key(struct page_s *p, int pos, uint64_t k)
+{
+	struct branch_s *b = (struct branch_s *)p;
+	uint64_t keys[BRANCH_NUM_PG];
+	gpid_t c[BRANCH_NUM_PG];
+	uint64_t d;
+
+	kvdb_assert(pos>0 && pos<p->h.record_num);
+	if ((p->h.flags & PAGE_COMPACT)==0) {
+		p->k[pos] = k;
+		return 0;
+	}
+	d = k - b->base;
+	if ((d & ((1ULL << b->shift) - 1))==0 && (d >> b->shift) <= UINT32_MAX) {
+		b->dk[pos] = (uint32_t)(d >> b->shift);
+		return 0;
+	}
+	br_decode(p, keys, c);
+	keys[pos] = k;
+	return br_encode(p, keys, c, p->h.record_num);
+}
+
+/* point the pos-th record at child, which must fit the encoding of the page */
+void br_set_child(struct page_s *p, int pos, gpid_t child)
+{
+	if (p->h.flags & PAGE_COMPACT) {
+		kvdb_assert(child<=UINT32_MAX);
+		((struct branch_s *)p)->c[pos] = (uint32_t)child;
+	} else {
+		p->v[pos] = child;
+	}
+}
+
+/*
+ * br_merge() -- append the records of r to l, its right sibling, sep is the
+ * key of r in their parent. The first key of r is replaced by sep, since its
+ * first child may hold keys below it. Return -1 if they do not fit l.
+ */
+int br_merge(struct page_s *l, struct page_s *r, uint64_t sep)
+{
+	uint64_t k[2*BRANCH_NUM_PG];
+	gpid_t c[2*BRANCH_NUM_PG];
+	int n = l->h.record_num;
+
+	br_decode(l, k, c);
+	br_decode(r, &k[n], &c[n]);
+	k[n] = sep;
+	return br_encode(l, k, c, n + r->h.record_num);
+}
+
+/*
+ * br_balance() -- move records between l and r, its right sibling, so that 
+ * l holds the first m of them all, sep is the key of r in their parent. The 
+ * new key of r is the m-th one. Return -1 if they do not fit, neither page
+ * is changed then.
+ */
+int br_balance(struct page_s *l, struct page_s *r, uint64_t sep, int m)
+{
+	uint64_t k[2*BRANCH_NUM_PG];
+	gpid_t c[2*BRANCH_NUM_PG];
+	struct page_s tl, tr;
+	int n = l->h.record_num;
+
+	br_decode(l, k, c);
+	br_decode(r, &k[n], &c[n]);
+	k[n] = sep;
+	n += r->h.record_num;
+	tl.h = l->h;
+	tr.h = r->h;
+	if (br_encode(&tl, k, c, m)!=0 || br_encode(&tr, &k[m], &c[m], n - m)!=0) {
+		return -1;
+	}
+	memcpy(l, &tl, sizeof(tl));
+	memcpy(r, &tr, sizeof(tr));
+	return 0;
+}
+
+/*
+ * br_split() -- move the records from the half-th on into the empty page np,
+ * both are encoded anew. Return the first key of np.
+ */
+uint64_t br_split(struct page_s *p, struct page_s *np, int half)
+{
+	uint64_t k[BRANCH_NUM_PG];
+	gpid_t c[BRANCH_NUM_PG];
+	int n = p->h.record_num;
+	int ret;
+
+	br_decode(p, k, c);
+	ret = br_encode(p, k, c, half);
+	kvdb_assert(ret==0);
+	ret = br_encode(np, &k[half], &c[half], n - half);
+	kvdb_assert(ret==0);
+	return k[half];
+}
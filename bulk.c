@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inner.h"
+
+/*
+ * Bulk load builds a tree bottom-up from records in key order. Leaves are
+ * filled one after another up to the fill factor and chained through h.next,
+ * every new page of a level adds a record to the open page of the level
+ * above, so only one page per level is pinned at any moment. Nothing is
+ * logged, kvdb_bulk_load() takes a checkpoint when it is done.
+ *
+ * Input which is not sorted is cut into runs of BULK_RUN records, each one
+ * is sorted in memory and spilled to a temporary file, and the runs are
+ * merged into the builder. If sorted input turns out of order after the
+ * first run has gone into the tree, the tree is finished with what it has
+ * and the rest is sorted the same way and put one by one.
+ *
+ * Of records with the same key, the last one read wins as with kvdb_put().
+ */
+
+#define BULK_RUN	(1024*1024)	// records sorted in memory at a time
+#define BULK_LEVEL_MAX	16
+#define BULK_FILL	90		// default fill factor, percent
+
+struct bulk_level_s {
+	pg_t pg;			// the open page, pinned
+	struct page_s *p;
+	gpid_t first_gpid;		// the first page of the level
+	uint64_t first_key;
+	uint64_t pages;
+};
+
+struct bulk_s {
+	kvdb_t d;
+	int fill;
+	uint64_t n;			// records in the tree
+	uint64_t last;			// the last key added
+	int level;			// levels built so far
+	struct bulk_level_s lv[BULK_LEVEL_MAX];
+};
+
+struct bulk_run_s {
+	FILE *f;
+	int seq;			// the order the run was written in
+	struct record_s r;
+};
+
+static void bulk_add_child(struct bulk_s *b, int l, uint64_t k, gpid_t child);
+
+static uint32_t bulk_limit(struct bulk_s *b, struct page_s *p)
+{
+	uint32_t n;
+
+	if (p->h.flags & PAGE_LEAF) {
+		n = RECORD_NUM_PG;
+	} else {
+		n = (p->h.flags & PAGE_COMPACT) ? BRANCH_NUM_PG : RECORD_NUM_PG;
+	}
+	n = n * b->fill / 100;
+	return n<2 ? 2 : n;
+}
+
+/*
+ * open a new page at level l whose first key is k, and add it to the level
+ * above. A branch page gets child as its first record.
+ */
+static void bulk_open(struct bulk_s *b, int l, uint64_t k, gpid_t child)
+{
+	struct bulk_level_s *lv = &b->lv[l];
+	struct page_s *p;
+	gpid_t gpid;
+	pg_t pg;
+
+	kvdb_assert(l<BULK_LEVEL_MAX);
+	gpid = alloc_page_near(b->d, 
+			lv->p!=NULL ? get_page_gpid(b->d, lv->pg) : GPID_NIL);
+	kvdb_assert(gpid!=GPID_NIL);
+	pg = get_page(b->d, gpid);
+	p = get_page_buf(b->d, pg);
+	if (l==0) {
+		p->h.record_num = 0;
+		p->h.flags = PAGE_KV | PAGE_LEAF;
+		p->h.next = GPID_NIL;
+	} else {
+		br_init(p, k, child);
+	}
+
+	if (lv->p!=NULL) {
+		lv->p->h.next = gpid;
+		mark_page_dirty(b->d, lv->pg);
+		put_page(b->d, lv->pg);
+	}
+	if (lv->pages==0) {
+		lv->first_gpid = gpid;
+		lv->first_key = k;
+		b->level = l + 1;
+	} else {
+		if (lv->pages==1) {
+			bulk_add_child(b, l+1, lv->first_key, lv->first_gpid);
+		}
+		bulk_add_child(b, l+1, k, gpid);
+	}
+	lv->pages ++;
+	lv->pg = pg;
+	lv->p = p;
+}
+
+static void bulk_add_child(struct bulk_s *b, int l, uint64_t k, gpid_t child)
+{
+	struct page_s *p = b->lv[l].p;
+
+	if (p!=NULL && (uint32_t)p->h.record_num<bulk_limit(b, p) &&
+	    br_insert(p, p->h.record_num-1, k, child, 0)==0) {
+		return;
+	}
+	bulk_open(b, l, k, child);
+}
+
+static void bulk_add(struct bulk_s *b, uint64_t k, uint64_t v)
+{
+	struct page_s *p = b->lv[0].p;
+
+	if (p!=NULL && k==b->last) {
+		p->v[p->h.record_num-1] = v;
+		return;
+	}
+	kvdb_assert(p==NULL || k>b->last);
+	if (p==NULL || (uint32_t)p->h.record_num>=bulk_limit(b, p)) {
+		bulk_open(b, 0, p==NULL ? k : br_sep(b->last, k), GPID_NIL);
+		p = b->lv[0].p;
+	}
+	p->k[p->h.record_num] = k;
+	p->v[p->h.record_num] = v;
+	p->h.record_num ++;
+	b->last = k;
+	b->n ++;
+}
+
+/* publish the tree built, the caller holds d->lock exclusively */
+static void bulk_finish(struct bulk_s *b)
+{
+	kvdb_t d = b->d;
+	gpid_t old;
+	int i;
+
+	if (b->level==0) {
+		return;
+	}
+	for (i=0; i<b->level; i++) {
+		mark_page_dirty(d, b->lv[i].pg);
+		put_page(d, b->lv[i].pg);
+	}
+
+	pthread_rwlock_wrlock(&d->root_latch);
+	old = d->h->root_gpid;
+	__atomic_store_n(&d->h->root_gpid, b->lv[b->level-1].first_gpid, __ATOMIC_RELEASE);
+	d->h->level = b->level;
+	d->h->record_num = b->n;
+	pthread_rwlock_unlock(&d->root_latch);
+
+	if (old!=GPID_NIL) {
+		free_tree(d, old);
+	}
+}
+
+/* stable merge sort of n records by key, tmp holds n records too */
+static void sort_recs(struct record_s *r, struct record_s *tmp, uint64_t n)
+{
+	struct record_s *src = r, *dst = tmp, *t;
+	uint64_t w, lo, mid, hi, i, j, o;
+
+	for (w=1; w<n; w*=2) {
+		for (lo=0; lo<n; lo+=2*w) {
+			mid = lo+w<n ? lo+w : n;
+			hi = lo+2*w<n ? lo+2*w : n;
+			i = lo; j = mid; o = lo;
+			while (i<mid && j<hi) {
+				dst[o++] = (src[j].k < src[i].k) ? src[j++] : src[i++];
+			}
+			while (i<mid) {
+				dst[o++] = src[i++];
+			}
+			while (j<hi) {
+				dst[o++] = src[j++];
+			}
+		}
+		t = src; src = dst; dst = t;
+	}
+	if (src!=r) {
+		memcpy(r, src, n * sizeof(*r));
+	}
+}
+
+static FILE *spill_run(struct record_s *r, uint64_t n)
+{
+	FILE *f;
+
+	f = tmpfile();
+	kvdb_assert(f!=NULL);
+	kvdb_assert(fwrite(r, sizeof(*r), n, f)==n);
+	kvdb_assert(fflush(f)==0);
+	rewind(f);
+	return f;
+}
+
+/* runs with a smaller key, or the same key from an earlier run, go first */
+static int run_before(struct bulk_run_s *a, struct bulk_run_s *b)
+{
+	return a->r.k < b->r.k || (a->r.k==b->r.k && a->seq < b->seq);
+}
+
+static void run_sift(struct bulk_run_s *h, int n, int i)
+{
+	struct bulk_run_s t;
+	int c;
+
+	for (;;) {
+		c = 2*i + 1;
+		if (c>=n)
+			break;
+		if (c+1<n && run_before(&h[c+1], &h[c]))
+			c ++;
+		if (!run_before(&h[c], &h[i]))
+			break;
+		t = h[i]; h[i] = h[c]; h[c] = t;
+		i = c;
+	}
+}
+
+/* merge the runs spilled into fn, in the order of keys */
+static void merge_runs(FILE **runs, int num,
+		void (*fn)(void *, uint64_t, uint64_t), void *arg)
+{
+	struct bulk_run_s *h;
+	int i, n = 0;
+
+	h = (struct bulk_run_s *)malloc(num * sizeof(*h));
+	kvdb_assert(h!=NULL);
+	for (i=0; i<num; i++) {
+		h[n].f = runs[i];
+		h[n].seq = i;
+		if (fread(&h[n].r, sizeof(h[n].r), 1, runs[i])==1)
+			n ++;
+	}
+	for (i=n/2-1; i>=0; i--) {
+		run_sift(h, n, i);
+	}
+	while (n>0) {
+		fn(arg, h[0].r.k, h[0].r.v);
+		if (fread(&h[0].r, sizeof(h[0].r), 1, h[0].f)!=1) {
+			h[0] = h[--n];
+		}
+		run_sift(h, n, 0);
+	}
+	for (i=0; i<num; i++) {
+		fclose(runs[i]);
+	}
+	free(h);
+}
+
+struct bulk_put_s {
+	kvdb_t d;
+	void (*put)(kvdb_t, uint64_t, uint64_t);
+};
+
+static void emit_add(void *arg, uint64_t k, uint64_t v)
+{
+	bulk_add((struct bulk_s *)arg, k, v);
+}
+
+static void emit_put(void *arg, uint64_t k, uint64_t v)
+{
+	struct bulk_put_s *bp = (struct bulk_put_s *)arg;
+
+	bp->put(bp->d, k, v);
+}
+
+/*
+ * bulk_load() -- load the records returned by next() into an empty database,
+ * the caller holds d->lock exclusively. put() stores a record the ordinary
+ * way, for input out of order after the tree has been started.
+ */
+void bulk_load(kvdb_t d, int (*next)(void *, uint64_t *, uint64_t *), void *arg,
+		int fill, void (*put)(kvdb_t, uint64_t, uint64_t))
+{
+	struct bulk_s *b;
+	struct bulk_put_s bp;
+	struct record_s *buf, *tmp, r;
+	FILE **runs = NULL;
+	int nruns = 0, sorted = 1, streaming = 0, late = 0;
+	uint64_t n = 0, i;
+
+	b = (struct bulk_s *)calloc(1, sizeof(*b));
+	buf = (struct record_s *)malloc(BULK_RUN * sizeof(*buf));
+	tmp = (struct record_s *)malloc(BULK_RUN * sizeof(*tmp));
+	kvdb_assert(b!=NULL && buf!=NULL && tmp!=NULL);
+	b->d = d;
+	b->fill = (fill>0 && fill<=100) ? fill : BULK_FILL;
+
+	while (next(arg, &r.k, &r.v)==0) {
+		if (streaming) {
+			if (r.k>=b->last) {
+				bulk_add(b, r.k, r.v);
+				continue;
+			}
+			streaming = 0;
+			late = 1;
+		}
+		if (n>0 && r.k<buf[n-1].k) {
+			sorted = 0;
+		}
+		buf[n++] = r;
+		if (n<BULK_RUN) {
+			continue;
+		}
+		if (sorted && nruns==0 && !late) {
+			/* sorted so far, go on without sorting */
+			for (i=0; i<n; i++) {
+				bulk_add(b, buf[i].k, buf[i].v);
+			}
+			streaming = 1;
+		} else {
+			if (!sorted) {
+				sort_recs(buf, tmp, n);
+			}
+			runs = (FILE **)realloc(runs, (nruns+1) * sizeof(FILE *));
+			kvdb_assert(runs!=NULL);
+			runs[nruns++] = spill_run(buf, n);
+		}
+		n = 0;
+		sorted = 1;
+	}
+	if (!sorted) {
+		sort_recs(buf, tmp, n);
+	}
+
+	bp.d = d;
+	bp.put = put;
+	if (nruns==0) {
+		for (i=0; i<n && !late; i++) {
+			bulk_add(b, buf[i].k, buf[i].v);
+		}
+		bulk_finish(b);
+		for (i=0; i<n && late; i++) {
+			put(d, buf[i].k, buf[i].v);
+		}
+	} else {
+		if (n>0) {
+			runs = (FILE **)realloc(runs, (nruns+1) * sizeof(FILE *));
+			kvdb_assert(runs!=NULL);
+			runs[nruns++] = spill_run(buf, n);
+		}
+		if (late) {
+			bulk_finish(b);
+			merge_runs(runs, nruns, emit_put, &bp);
+		} else {
+			merge_runs(runs, nruns, emit_add, b);
+			bulk_finish(b);
+		}
+	}
+
+	free(runs);
+	free(tmp);
+	free(buf);
+	free(b);
+}
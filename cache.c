@@ -2,18 +2,92 @@
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <fcntl.h>
 
 #include "inner.h"
 
-#define MAX_CACHE_SIZE	(1ULL<<20)		// 1MB for test
-#define MAX_MAPPED_PG	(MAX_CACHE_SIZE/PAGE_SIZE)
-#define EVECT_NUM	(128)
 
-#define PAGE_HASH_NUM	(MAX_MAPPED_PG)
-#define PAGE_HASH_MASK	(MAX_MAPPED_PG - 1)
+/*
+ * A miss in a full cache evicts a few pages, 2Q style: a page comes in cold 
+ * and only becomes hot if it is asked for again while it is cached. Cold 
+ * pages are evicted first as long as COLD_MIN of them are left, so a scan, 
+ * which touches each page once, does not push the branch pages and the hot
+ * leaves out of the cache. In the mmap modes the free pages are kept on a 
+ * cold and a hot list, in CACHE_DIRECT mode the clock hand passes hot pages 
+ * by unless they take more than all but COLD_MIN of the frames.
+ */
+#define EVICT_NUM	(4)
+#define COLD_MIN(ch)	((ch)->max_pg/4)
+
+
+/*
+ * Pages are looked up in an open addressing table keyed by gpid, with linear
+ * probing. A slot holds the gpid next to its descriptor, so a lookup only 
+ * reads the cache line its probe starts in, rarely the next one: the table 
+ * has at least twice as many slots as there are descriptors. The descriptors
+ * are allocated once with the cache, in CACHE_DIRECT mode one per frame, in 
+ * the other modes twice the pages the cache keeps: the pages mapped and 
+ * those still pinned or under writeback when eviction has brought the others
+ * down. They come in slabs, so that the cache could grow while descriptors 
+ * are pinned, see resize_cache().
+ */
+#define SLOT_ALIGN	(64)
+
+/*
+ * Branch pages are pinned for good, up to a quarter of the cache: the pin 
+ * table holds a reference on them. It is an open addressing table like the 
+ * page table, which get_page() reads without ch->lock. A pinned page is then
+ * got and put by bumping its pin count atomically, without the lock, the 
+ * page table or the lru lists. Only the transitions of the pin count from and
+ * to 0 need ch->lock, and a pinned page never makes them. A stale entry found
+ * in the table is caught by the gpid of the page, once it is pinned.
+ */
+#define PIN_DIV		(4)
 
 #define PG_DIRTY	(1<<0)
-#define PG_BUSY		(1<<1)
+#define PG_MAPPED	(1<<2)	// buf is a private mmap() of this page
+#define PG_REF		(1<<3)	// referenced since the clock hand passed by
+#define PG_WRITEBACK	(1<<4)	// the flusher is writing the page out
+#define PG_RETIRED	(1<<5)	// the frame is given up once the page is free
+#define PG_HOT		(1<<6)	// asked for again, on the hot list when free
+#define PG_PINNED	(1<<7)	// in the pin table
+
+/*
+ * Dirty pages are written back by the flusher thread. It wakes up when
+ * DIRTY_LOW_PG pages are dirty or every FLUSH_INTERVAL seconds, and writers
+ * are held back in mark_page_dirty() while DIRTY_HIGH_PG pages are dirty.
+ */
+#define DIRTY_LOW_PG(ch)	((ch)->max_pg/8)
+#define DIRTY_HIGH_PG(ch)	((ch)->max_pg/2)
+#define FLUSH_BATCH	(256)		// max pages written back per round
+#define FLUSH_INTERVAL	(1)		// seconds
+
+/*
+ * In CACHE_MMAP_AREA mode the whole data area is reserved once as an
+ * inaccessible anonymous mapping and the file is mapped into it with
+ * MAP_FIXED as it grows, so a page is found at area + (pos - FILE_META_LEN).
+ * If the reservation fails we retry with halves of it down to AREA_MIN_LEN.
+ */
+#define AREA_RESERVE_LEN	(1ULL<<40)	// 1TB of address space
+#define AREA_MIN_LEN		(1ULL<<30)
+
+/*
+ * Pages in the area could also be read without pinning or latching them, 
+ * their addresses never change. Such readers validate what they have read
+ * against a version which is kept for every stripe of pages: its low bits
+ * count the writers holding an exclusive latch on a page of the stripe, the
+ * high bits are bumped every time one of them releases it. A stripe shared 
+ * by several pages only costs readers of them a spurious retry. The versions
+ * are kept in the other modes too, for cursors which come back to a leaf.
+ */
+#define VER_STRIPE_NUM		(1<<16)
+#define VER_STRIPE_MASK		(VER_STRIPE_NUM - 1)
+#define VER_WRITERS		((1ULL<<16) - 1)
+#define VER_ONE			(1ULL<<16)
 
 struct node_s {
 	struct node_s *prev;
@@ -22,20 +96,60 @@ struct node_s {
 
 struct pg_s {
 	uint32_t flags;		// off:0
-	uint32_t reserv;	
+	uint32_t ref;		// pin count, the page is busy while it is not 0
 	gpid_t gpid;		// off:8
 	struct page_s *buf; 	// off:16
-	struct node_s hash;	// for hash, off:24
-	struct node_s link;	// for lru, off:40
+	struct node_s link;	// for lru or the spare list, off:24
+	pthread_rwlock_t latch;	// protects the content of the page
+	int wlatched;		// latched exclusively, only the holder touches it
+};
+
+struct slab_s {
+	struct slab_s *next;
+	struct pg_s *pgs;
+	char *frames;		// CACHE_DIRECT: a frame for each of pgs
+	uint64_t num;
+};
+
+struct slot_s {
+	gpid_t gpid;
+	struct pg_s *p;		// NULL if the slot is empty
 };
 
 struct cache_s {
+	int mode;				// CACHE_MMAP_PAGE/MMAP_AREA/DIRECT
+	char *area;				// reserved mapping of the data area
+	uint64_t area_len;			// bytes reserved at area
+	uint64_t area_mapped;			// bytes of the file mapped at area
+	uint64_t max_pg;			// pages the cache keeps
+	struct slab_s *slabs;
+	struct pg_s **pgs;			// all page descriptors
+	uint64_t pg_num;
+	uint64_t frame_num;			// CACHE_DIRECT: frames in use
+	uint64_t hand;				// CACHE_DIRECT: clock hand
 	uint64_t mapped_num;
 	uint64_t busy_num;
-	uint64_t free_num;
-	struct node_s hash[PAGE_HASH_NUM];
-	struct node_s free;			// free list head
+	uint64_t free_num;			// on the free and hot lists
+	uint64_t hot_num;
+	uint64_t hot_pg;			// pages with PG_HOT, free or not
+	uint64_t dirty_num;
+	pthread_mutex_t lock;			// protects everything in the cache
+	pthread_cond_t flush_cond;		// wakes up the flusher
+	pthread_cond_t clean_cond;		// the flusher has finished a round
+	pthread_t flusher;
+	int flusher_stop;
+	uint64_t flush_round;
+	uint64_t *versions;			// per stripe of pages
+	struct slot_s *slots;			// page table
+	uint64_t slot_mask;
+	struct slot_s *pins;			// pinned pages
+	uint64_t pin_mask;
+	uint64_t pin_num;
+	uint64_t pin_max;
+	struct node_s free;			// free list head, cold pages
+	struct node_s hot;			// free pages asked for again
 	struct node_s busy;			// busy list head
+	struct node_s spare;			// descriptors not in use
 };
 
 
@@ -85,200 +199,1202 @@ int list_empty(struct node_s *h)
 
 struct pg_s *link_pg(struct node_s *n)
 {
-	long off = (long)(char *)(&((struct pg_s *)0)->link); //off:40
+	long off = (long)(char *)(&((struct pg_s *)0)->link); //off:24
 	char *ptr = (char *)n - off;
 	return (struct pg_s *)ptr;
 }
 
-struct pg_s *hash_pg(struct node_s *n)
+static uint64_t gpid_hash(gpid_t gpid, uint64_t mask)
 {
-	long off = (long)(char *)(&((struct pg_s *)0)->hash);//off:24
-	char *ptr = (char *)n - off;
-	return (struct pg_s *)ptr;
+	return ((gpid * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+static uint64_t pg_hash(struct cache_s *ch, gpid_t gpid)
+{
+	return gpid_hash(gpid, ch->slot_mask);
+}
+
+static struct pg_s *find_page(struct cache_s *ch, gpid_t gpid)
+{
+	uint64_t i;
+
+	for (i=pg_hash(ch, gpid); ch->slots[i].p!=NULL; i=(i+1) & ch->slot_mask) {
+		if (ch->slots[i].gpid==gpid)
+			return ch->slots[i].p;
+	}
+	return NULL;
+}
+
+static void insert_page(struct cache_s *ch, struct pg_s *p)
+{
+	uint64_t i;
+
+	for (i=pg_hash(ch, p->gpid); ch->slots[i].p!=NULL; i=(i+1) & ch->slot_mask)
+		;
+	ch->slots[i].gpid = p->gpid;
+	ch->slots[i].p = p;
+}
+
+/*
+ * remove_page() -- empty the slot of p and move back the entries after it 
+ * which could not be found any more across the hole, so that no tombstones
+ * are needed.
+ */
+static void remove_page(struct cache_s *ch, struct pg_s *p)
+{
+	uint64_t i, j, k;
+
+	for (i=pg_hash(ch, p->gpid); ch->slots[i].p!=p; i=(i+1) & ch->slot_mask)
+		kvdb_assert(ch->slots[i].p!=NULL);
+	for (j=i; ; ) {
+		ch->slots[i].p = NULL;
+		do {
+			j = (j + 1) & ch->slot_mask;
+			if (ch->slots[j].p==NULL)
+				return;
+			k = pg_hash(ch, ch->slots[j].gpid);
+		} while (i<=j ? (i<k && k<=j) : (i<k || k<=j));
+		ch->slots[i] = ch->slots[j];
+		i = j;
+	}
+}
+
+/* look a page up in the pin table, without ch->lock */
+static struct pg_s *find_pinned(struct cache_s *ch, gpid_t gpid)
+{
+	uint64_t i, n;
+	struct pg_s *p;
+
+	i = gpid_hash(gpid, ch->pin_mask);
+	for (n=0; n<=ch->pin_mask; n++) {
+		p = __atomic_load_n(&ch->pins[i].p, __ATOMIC_ACQUIRE);
+		if (p==NULL)
+			return NULL;
+		if (__atomic_load_n(&ch->pins[i].gpid, __ATOMIC_RELAXED)==gpid)
+			return p;
+		i = (i + 1) & ch->pin_mask;
+	}
+	return NULL;
+}
+
+static void set_pin_slot(struct slot_s *slot, gpid_t gpid, struct pg_s *p)
+{
+	__atomic_store_n(&slot->gpid, gpid, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->p, p, __ATOMIC_RELEASE);
+}
+
+/* like insert_page() and remove_page(), with ch->lock held */
+static void insert_pinned(struct cache_s *ch, struct pg_s *p)
+{
+	uint64_t i;
+
+	for (i=gpid_hash(p->gpid, ch->pin_mask); ch->pins[i].p!=NULL; i=(i+1) & ch->pin_mask)
+		;
+	set_pin_slot(&ch->pins[i], p->gpid, p);
+}
+
+static void remove_pinned(struct cache_s *ch, struct pg_s *p)
+{
+	uint64_t i, j, k;
+
+	for (i=gpid_hash(p->gpid, ch->pin_mask); ch->pins[i].p!=p; i=(i+1) & ch->pin_mask)
+		kvdb_assert(ch->pins[i].p!=NULL);
+	for (j=i; ; ) {
+		set_pin_slot(&ch->pins[i], GPID_NIL, NULL);
+		do {
+			j = (j + 1) & ch->pin_mask;
+			if (ch->pins[j].p==NULL)
+				return;
+			k = gpid_hash(ch->pins[j].gpid, ch->pin_mask);
+		} while (i<=j ? (i<k && k<=j) : (i<k || k<=j));
+		set_pin_slot(&ch->pins[i], ch->pins[j].gpid, ch->pins[j].p);
+		i = j;
+	}
 }
 
 void dump_cache(kvdb_t d)
 {
-	int i;
+	uint64_t i;
 	struct cache_s *ch = d->ch;
-	struct node_s *h, *n;
 	struct pg_s *p;
 	
 	fprintf(stderr, "dump_cache(): \n");
 	fprintf(stderr, "  mapped_num = %lu\n", ch->mapped_num);
 	fprintf(stderr, "  busy_num = %lu\n", ch->busy_num);
 	fprintf(stderr, "  free_num = %lu\n", ch->free_num);
-	for (i=0; i<PAGE_HASH_NUM; i++) {
-		h = &ch->hash[i];
-		if (list_empty(h))
+	fprintf(stderr, "  hot_num = %lu\n", ch->hot_num);
+	fprintf(stderr, "  pin_num = %lu\n", ch->pin_num);
+	for (i=0; i<=ch->slot_mask; i++) {
+		p = ch->slots[i].p;
+		if (p==NULL)
 			continue;
-		for (n=h->next; n!=h; n=n->next) {
-			p = hash_pg(n);
-			fprintf(stderr, "  i=%4d p=%p  flg=%8x  gpid=%8lu  buf=%p \n", 
-				i, p, p->flags, p->gpid, p->buf);
-		}
+		fprintf(stderr, "  i=%4lu p=%p  flg=%8x  gpid=%8lu  buf=%p \n", 
+			i, p, p->flags, p->gpid, p->buf);
 	}
 	fprintf(stderr, "\n");
 }
 
+/* the gauges of the cache for kvdb_get_stats() */
+void get_cache_stats(kvdb_t db, struct kvdb_stats_s *st)
+{
+	struct cache_s *ch = db->ch;
+
+	pthread_mutex_lock(&ch->lock);
+	st->cache_pages = ch->mapped_num;
+	st->cache_dirty = ch->dirty_num;
+	st->cache_pinned = ch->pin_num;
+	st->cache_max = ch->max_pg;
+	pthread_mutex_unlock(&ch->lock);
+}
+
+static void *flusher_main(void *arg);
+static void unpin_from(kvdb_t db, gpid_t gpid);
+
+/* reserve address space for the data area, return 0 if we could not */
+static int reserve_area(struct cache_s *ch)
+{
+	uint64_t len;
+	void *a;
+
+	for (len=AREA_RESERVE_LEN; len>=AREA_MIN_LEN; len/=2) {
+		a = mmap(NULL, len, PROT_NONE, 
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (a!=MAP_FAILED) {
+			ch->area = (char *)a;
+			ch->area_len = len;
+			ch->area_mapped = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * grow_cache_area() -- map the file into the reserved area up to file_size,
+ * it is called by file_allocate() every time the file gets longer.
+ */
+void grow_cache_area(kvdb_t db, uint64_t file_size)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t len;
+	void *a;
+
+	if (ch==NULL || ch->mode!=CACHE_MMAP_AREA || file_size<=FILE_META_LEN)
+		return;
+
+	len = file_size - FILE_META_LEN;
+	if (len>ch->area_len)
+		len = ch->area_len;
+	pthread_mutex_lock(&ch->lock);
+	if (len>ch->area_mapped) {
+		a = mmap(ch->area + ch->area_mapped, len - ch->area_mapped, 
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, 
+			db->fd, FILE_META_LEN + ch->area_mapped);
+		kvdb_assert(a!=MAP_FAILED);
+		__atomic_store_n(&ch->area_mapped, len, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&ch->lock);
+}
+
+/*
+ * shrink_cache_area() -- unmap the file from the area beyond file_size before
+ * the file is cut there. Zeroes are mapped in its place, so that optimistic
+ * readers still on their way to a page there read something they will not
+ * validate instead of faulting. The file is mapped again as it grows back.
+ */
+void shrink_cache_area(kvdb_t db, uint64_t file_size)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t len, old;
+	void *a;
+
+	if (ch->mode!=CACHE_MMAP_AREA) {
+		return;
+	}
+	len = file_size>FILE_META_LEN ? file_size - FILE_META_LEN : 0;
+	pthread_mutex_lock(&ch->lock);
+	old = ch->area_mapped;
+	if (len<old) {
+		__atomic_store_n(&ch->area_mapped, len, __ATOMIC_RELEASE);
+		a = mmap(ch->area + len, old - len, PROT_READ, 
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0);
+		kvdb_assert(a!=MAP_FAILED);
+	}
+	pthread_mutex_unlock(&ch->lock);
+}
+
+/*
+ * grow_slots() -- make the page table twice as large as the descriptors at
+ * least, and put back the pages that are in it.
+ */
+static void grow_slots(struct cache_s *ch)
+{
+	struct slot_s *old = ch->slots;
+	uint64_t i, n, old_num;
+	int ret;
+
+	old_num = old!=NULL ? ch->slot_mask + 1 : 0;
+	for (n=1; n<2*ch->pg_num; n*=2)
+		;
+	if (n<=old_num) {
+		return;
+	}
+	ret = posix_memalign((void **)&ch->slots, SLOT_ALIGN, n * sizeof(struct slot_s));
+	kvdb_assert(ret==0);
+	memset(ch->slots, 0, n * sizeof(struct slot_s));
+	ch->slot_mask = n - 1;
+	for (i=0; i<old_num; i++) {
+		if (old[i].p!=NULL) {
+			insert_page(ch, old[i].p);
+		}
+	}
+	free(old);
+}
+
+/* 
+ * add_pages() -- add a slab of n page descriptors, in CACHE_DIRECT mode with
+ * a frame for each, mapped on their own so that they are aligned to PAGE_SIZE
+ * for O_DIRECT I/O and could be given back to the system one by one.
+ */
+static void add_pages(struct cache_s *ch, uint64_t n)
+{
+	struct slab_s *sl;
+	struct pg_s *p;
+	uint64_t i;
+
+	sl = (struct slab_s *)malloc(sizeof(*sl));
+	kvdb_assert(sl!=NULL);
+	sl->num = n;
+	sl->pgs = (struct pg_s *)malloc(n * sizeof(struct pg_s));
+	kvdb_assert(sl->pgs!=NULL);
+	sl->frames = NULL;
+	if (ch->mode==CACHE_DIRECT) {
+		sl->frames = (char *)mmap(NULL, n * PAGE_SIZE, PROT_READ|PROT_WRITE, 
+				MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		kvdb_assert(sl->frames!=MAP_FAILED);
+	}
+	sl->next = ch->slabs;
+	ch->slabs = sl;
+
+	ch->pgs = (struct pg_s **)realloc(ch->pgs, (ch->pg_num + n) * sizeof(struct pg_s *));
+	kvdb_assert(ch->pgs!=NULL);
+	for (i=0; i<n; i++) {
+		p = &sl->pgs[i];
+		p->flags = 0;
+		p->ref = 0;
+		p->gpid = GPID_NIL;	// the descriptor is not in use
+		pthread_rwlock_init(&p->latch, NULL);
+		p->wlatched = 0;
+		if (ch->mode==CACHE_DIRECT) {
+			p->buf = (struct page_s *)(sl->frames + i*PAGE_SIZE);
+			list_init(&p->link);
+		} else {
+			p->buf = NULL;
+			list_add_tail(&p->link, &ch->spare);
+		}
+		ch->pgs[ch->pg_num++] = p;
+	}
+	grow_slots(ch);
+}
+
 void init_cache(kvdb_t db)
 {
 	struct cache_s *ch; 
+	uint64_t n;
 	int i;
 
 	ch = (struct cache_s *)malloc(sizeof(*ch));
 	kvdb_assert(ch!=NULL);
 	
 	db->ch = ch;
+	ch->mode = db->cache_mode;
+	ch->area = NULL;
+	ch->area_len = 0;
+	ch->area_mapped = 0;
+	ch->max_pg = db->cache_pg;
+	ch->slabs = NULL;
+	ch->pgs = NULL;
+	ch->pg_num = 0;
+	ch->frame_num = 0;
+	ch->hand = 0;
 	ch->mapped_num = 0;
+	ch->busy_num = 0;
+	ch->free_num = 0;
+	ch->hot_num = 0;
+	ch->hot_pg = 0;
+	ch->dirty_num = 0;
+	ch->flusher_stop = 0;
+	ch->flush_round = 0;
+	ch->versions = NULL;
+	ch->slots = NULL;
+	ch->slot_mask = 0;
+	ch->pins = NULL;
+	ch->pin_mask = 0;
+	ch->pin_num = 0;
+	ch->pin_max = 0;
+	pthread_mutex_init(&ch->lock, NULL);
+	pthread_cond_init(&ch->flush_cond, NULL);
+	pthread_cond_init(&ch->clean_cond, NULL);
 	list_init(&ch->free);
+	list_init(&ch->hot);
 	list_init(&ch->busy);
-	for (i=0; i<PAGE_HASH_NUM; i++) {
-		list_init(&ch->hash[i]);
+	list_init(&ch->spare);
+
+	if (ch->mode==CACHE_MMAP_AREA && !reserve_area(ch)) {
+		fprintf(stderr, "init_cache(): cannot reserve the data area, "
+				"fall back to mapping per page\n");
+		ch->mode = CACHE_MMAP_PAGE;
+	}
+	ch->versions = (uint64_t *)calloc(VER_STRIPE_NUM, sizeof(uint64_t));
+	kvdb_assert(ch->versions!=NULL);
+	if (ch->mode==CACHE_DIRECT) {
+		add_pages(ch, ch->max_pg);
+		ch->frame_num = ch->max_pg;
+	} else {
+		add_pages(ch, 2*ch->max_pg);
+	}
+	/* readers do not take ch->lock, so the pin table never moves */
+	for (n=1; n<2*(ch->max_pg/PIN_DIV); n*=2)
+		;
+	ch->pins = (struct slot_s *)calloc(n, sizeof(struct slot_s));
+	kvdb_assert(ch->pins!=NULL);
+	ch->pin_mask = n - 1;
+	ch->pin_max = ch->max_pg/PIN_DIV;
+	grow_cache_area(db, db->h->file_size);
+
+	i = pthread_create(&ch->flusher, NULL, flusher_main, db);
+	kvdb_assert(i==0);
+}
+
+/*
+ * map_page() -- make p->buf point to the page, in CACHE_MMAP_AREA mode it is
+ * only an offset into the area unless the page lies beyond the reservation.
+ */
+static void map_page(kvdb_t db, struct pg_s *p)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t off;
+
+	off = get_page_pos(p->gpid) - FILE_META_LEN;
+	if (ch->mode==CACHE_MMAP_AREA && off + PAGE_SIZE<=ch->area_mapped) {
+		p->buf = (struct page_s *)(ch->area + off);
+		return;
+	}
+	p->buf = (struct page_s *)mmap(NULL, PAGE_SIZE, 
+					PROT_READ|PROT_WRITE, 
+					MAP_SHARED, 
+					db->fd, FILE_META_LEN + off);
+	kvdb_assert(p->buf!=MAP_FAILED);
+	p->flags |= PG_MAPPED;
+}
+
+/* read a page into its frame in CACHE_DIRECT mode */
+static void read_page(kvdb_t db, struct pg_s *p)
+{
+	ssize_t ret;
+
+	ret = pread(db->fd, p->buf, PAGE_SIZE, get_page_pos(p->gpid));
+	kvdb_assert(ret==(ssize_t)PAGE_SIZE);
+	stat_add(db, STAT_PREAD, 1);
+	stat_add(db, STAT_PREAD_BYTES, PAGE_SIZE);
+}
+
+static void unmap_page(kvdb_t db, struct pg_s *p)
+{
+	int ret; 
+
+	if (p->flags & PG_MAPPED) {
+		ret = munmap(p->buf, PAGE_SIZE);
+		p->flags &= ~PG_MAPPED;
+	} else {
+		/* the data stays in the file, only drop our page table entries */
+		ret = madvise(p->buf, PAGE_SIZE, MADV_DONTNEED);
 	}
+	kvdb_assert(ret==0);
+	p->buf = NULL;
 }
 
-void walk_link_page(struct node_s *head, void (*fn)(struct pg_s *))
+void walk_link_page(kvdb_t db, struct node_s *head, void (*fn)(kvdb_t, struct pg_s *))
 {
 	struct node_s *n; 
 	struct pg_s *p;
 
 	for (n=head->next; n!=head; n=n->next) {
 		p = link_pg(n);
-		fn(p);
+		fn(db, p);
 	}
 }
 
-void sync_page(struct pg_s *p) //write in the page
+/* 
+ * write_run() -- write back n pages whose gpids are consecutive. A run costs
+ * a single msync() of the area or a single pwritev() of the frames, only
+ * pages mapped on their own have to be synced one by one.
+ */
+static void write_run(kvdb_t db, struct pg_s **v, int n)
+{
+	struct cache_s *ch = db->ch;
+	struct iovec iov[FLUSH_BATCH];
+	ssize_t ret;
+	int i;
+
+	stat_add(db, STAT_CACHE_WRITEBACK, n);
+	if (ch->mode==CACHE_DIRECT) {
+		kvdb_assert(n<=FLUSH_BATCH);
+		for (i=0; i<n; i++) {
+			iov[i].iov_base = v[i]->buf;
+			iov[i].iov_len = PAGE_SIZE;
+		}
+		ret = pwritev(db->fd, iov, n, get_page_pos(v[0]->gpid));
+		kvdb_assert(ret==(ssize_t)(n*PAGE_SIZE));
+		stat_add(db, STAT_PWRITE, 1);
+		stat_add(db, STAT_PWRITE_BYTES, n*PAGE_SIZE);
+	} else if ((v[0]->flags & PG_MAPPED)==0) {
+		/* all of the run is in the area since the gpids are consecutive */
+		ret = msync(v[0]->buf, n*PAGE_SIZE, MS_SYNC);
+		kvdb_assert(ret==0);
+		stat_add(db, STAT_MSYNC, 1);
+	} else {
+		for (i=0; i<n; i++) {
+			ret = msync(v[i]->buf, PAGE_SIZE, MS_SYNC);
+			kvdb_assert(ret==0);
+		}
+		stat_add(db, STAT_MSYNC, n);
+	}
+	if (ch->mode!=CACHE_DIRECT) {
+		stat_add(db, STAT_MSYNC_BYTES, n*PAGE_SIZE);
+	}
+}
+
+static int has_writeback(struct cache_s *ch)
+{
+	struct node_s *n;
+
+	for (n=ch->free.next; n!=&ch->free; n=n->next) {
+		if (link_pg(n)->flags & PG_WRITEBACK)
+			return 1;
+	}
+	for (n=ch->hot.next; n!=&ch->hot; n=n->next) {
+		if (link_pg(n)->flags & PG_WRITEBACK)
+			return 1;
+	}
+	for (n=ch->busy.next; n!=&ch->busy; n=n->next) {
+		if (link_pg(n)->flags & PG_WRITEBACK)
+			return 1;
+	}
+	return 0;
+}
+
+/* must be called with ch->lock held, and p must not be under writeback */
+void sync_page(kvdb_t db, struct pg_s *p) //write in the page
 {
-	int ret;
 	if ((p->flags & PG_DIRTY) == 0)
 		return;
-	ret = msync(p->buf, PAGE_SIZE, MS_SYNC);
-	kvdb_assert(ret==0);
+	write_run(db, &p, 1);
 	p->flags &= ~PG_DIRTY;
+	db->ch->dirty_num --;
 }
 
 void sync_all_page(kvdb_t db)
 {
-	walk_link_page(&db->ch->free, sync_page);
-	walk_link_page(&db->ch->busy, sync_page);
+	pthread_mutex_lock(&db->ch->lock);
+	/* let the flusher finish the pages it has taken */
+	while (has_writeback(db->ch)) {
+		pthread_cond_wait(&db->ch->clean_cond, &db->ch->lock);
+	}
+	walk_link_page(db, &db->ch->free, sync_page);
+	walk_link_page(db, &db->ch->hot, sync_page);
+	walk_link_page(db, &db->ch->busy, sync_page);
+	pthread_mutex_unlock(&db->ch->lock);
 }
 
 void evict_page(kvdb_t db, struct pg_s *p)
 {
-	int ret; 
-
-	if ((p->flags & PG_DIRTY) != 0) {
-		ret = msync(p->buf, PAGE_SIZE, MS_SYNC);
-		kvdb_assert(ret==0);
-		p->flags &= ~PG_DIRTY;
-	}
+	kvdb_assert((p->flags & PG_WRITEBACK) == 0);
+	sync_page(db, p);
 	list_del(&p->link);
-	list_del(&p->hash);
-	ret = munmap(p->buf, PAGE_SIZE);
-	kvdb_assert(ret==0);
+	remove_page(db->ch, p);
 	db->ch->mapped_num --;
-	if (p->flags & PG_BUSY) {
+	if (p->ref>0) {
 		db->ch->busy_num --;
 	} else {
 		db->ch->free_num --;
+		db->ch->hot_num -= (p->flags & PG_HOT) ? 1 : 0;
+	}
+	db->ch->hot_pg -= (p->flags & PG_HOT) ? 1 : 0;
+	if (db->ch->mode==CACHE_DIRECT) {
+		/* the frame goes back to the pool */
+		if (p->flags & PG_RETIRED) {
+			madvise(p->buf, PAGE_SIZE, MADV_DONTNEED);
+		}
+		p->flags = 0;
+		p->gpid = GPID_NIL;
+		return;
+	}
+	unmap_page(db, p);
+	p->flags = 0;
+	p->gpid = GPID_NIL;
+	list_add(&p->link, &db->ch->spare);
+}
+
+/*
+ * discard_pages() -- drop the pages from gpid on out of the cache without
+ * writing them back, they are free and the file is about to be cut there.
+ * Pages somebody still has pinned stay, return the page after the last of
+ * them, or gpid if there is none: the file must not be cut before it.
+ */
+gpid_t discard_pages(kvdb_t db, gpid_t gpid)
+{
+	struct cache_s *ch = db->ch;
+	struct node_s *heads[2] = { &ch->free, &ch->hot };
+	struct node_s *n, *next;
+	struct pg_s *p;
+	gpid_t end = gpid;
+	int i;
+
+	pthread_mutex_lock(&ch->lock);
+	unpin_from(db, gpid);
+	for (n=ch->busy.next; n!=&ch->busy; n=n->next) {
+		p = link_pg(n);
+		if (p->gpid>=end) {
+			end = p->gpid + 1;
+		}
+	}
+	for (i=0; i<2; i++) {
+		for (n=heads[i]->next; n!=heads[i]; n=next) {
+			next = n->next;
+			p = link_pg(n);
+			if (p->gpid<gpid) {
+				continue;
+			}
+			if (p->flags & PG_WRITEBACK) {
+				end = p->gpid>=end ? p->gpid + 1 : end;
+				continue;
+			}
+			if (p->flags & PG_DIRTY) {
+				p->flags &= ~PG_DIRTY;
+				ch->dirty_num --;
+			}
+			evict_page(db, p);
+		}
+	}
+	pthread_mutex_unlock(&ch->lock);
+	return end;
+}
+
+/*
+ * evict_list() -- evict free pages without any of the flags in skip from the
+ * end of a list until only 'target' pages are mapped, or the free list only
+ * holds 'cold' pages.
+ */
+static void evict_list(kvdb_t db, struct node_s *head, uint64_t target, 
+		uint64_t cold, uint32_t skip)
+{
+	struct cache_s *ch = db->ch;
+	struct node_s *n, *prev;
+	struct pg_s *p;
+
+	for (n=head->prev; n!=head && ch->mapped_num>target; n=prev) {
+		if (head==&ch->free && ch->free_num - ch->hot_num<=cold)
+			break;
+		prev = n->prev;
+		p = link_pg(n);
+		if ((p->flags & skip) == 0) {
+			evict_page(db, p);
+			stat_add(db, STAT_CACHE_EVICT, 1);
+		}
+	}
+}
+
+/*
+ * evict_free_pages() -- evict free pages until only 'target' pages are 
+ * mapped, cold ones first as long as there are COLD_MIN of them. Clean pages
+ * are taken first so that no write is done here, dirty ones only if that is
+ * not enough to get below max_pg.
+ */
+static void evict_free_pages(kvdb_t db, uint64_t target)
+{
+	struct cache_s *ch = db->ch;
+
+	evict_list(db, &ch->free, target, COLD_MIN(ch), PG_DIRTY|PG_WRITEBACK);
+	evict_list(db, &ch->hot, target, 0, PG_DIRTY|PG_WRITEBACK);
+	evict_list(db, &ch->free, target, 0, PG_DIRTY|PG_WRITEBACK);
+	if (ch->dirty_num>0) {
+		pthread_cond_signal(&ch->flush_cond);
+	}
+	evict_list(db, &ch->free, ch->max_pg - 1, 0, PG_WRITEBACK);
+	evict_list(db, &ch->hot, ch->max_pg - 1, 0, PG_WRITEBACK);
+}
+
+/*
+ * clock_victim() -- pick a frame for a new page in CACHE_DIRECT mode. The
+ * hand sweeps over the frames, an empty frame is taken at once, a page
+ * referenced since the last sweep gets a second chance and busy pages are
+ * skipped. Hot pages are passed by as long as there are not too many of 
+ * them, else one not referenced since the last sweep becomes cold again, and
+ * in the last sweep if the cold ones are all busy. Dirty pages are left to
+ * the flusher during the first sweep, after that the page in the frame is
+ * written back here if needed.
+ */
+static struct pg_s *clock_victim(kvdb_t db)
+{
+	struct cache_s *ch = db->ch;
+	struct pg_s *p;
+	uint64_t n;
+
+	for (n=0; n<3*ch->frame_num; n++) {
+		p = ch->pgs[ch->hand];
+		ch->hand = (ch->hand + 1) % ch->frame_num;
+		if (p->gpid==GPID_NIL) {
+			return p;
+		}
+		if (p->ref>0 || (p->flags & PG_WRITEBACK)) {
+			continue;
+		}
+		if (p->flags & PG_REF) {
+			p->flags &= ~PG_REF;
+			continue;
+		}
+		if ((p->flags & PG_HOT) && n<2*ch->frame_num) {
+			if (ch->hot_pg + COLD_MIN(ch)>ch->frame_num) {
+				p->flags &= ~PG_HOT;
+				ch->hot_pg --;
+				list_del(&p->link);
+				list_add(&p->link, &ch->free);
+				ch->hot_num --;
+			}
+			continue;
+		}
+		if ((p->flags & PG_DIRTY) && n<ch->frame_num) {
+			pthread_cond_signal(&ch->flush_cond);
+			continue;
+		}
+		evict_page(db, p);
+		stat_add(db, STAT_CACHE_EVICT, 1);
+		return p;
+	}
+	/* all frames are busy, the cache is too small */
+	kvdb_assert(0);
+	return NULL;
+}
+
+/*
+ * retire_frame() -- give up a frame in CACHE_DIRECT mode, its memory goes
+ * back to the system. A page in it which is pinned or under writeback stays
+ * until put_page() or the flusher is done with it.
+ */
+static void retire_frame(kvdb_t db, struct pg_s *p)
+{
+	if (p->gpid==GPID_NIL) {
+		madvise(p->buf, PAGE_SIZE, MADV_DONTNEED);
+		return;
+	}
+	p->flags |= PG_RETIRED;
+	if (p->ref==0 && (p->flags & PG_WRITEBACK)==0) {
+		evict_page(db, p);
+		stat_add(db, STAT_CACHE_EVICT, 1);
 	}
-	free(p);
+}
+
+/*
+ * resize_cache() -- let the cache keep max_pg pages from now on. Growing it
+ * adds descriptors, and frames in CACHE_DIRECT mode. Shrinking it evicts 
+ * what no longer fits, only pinned pages stay beyond it until they are free.
+ */
+void resize_cache(kvdb_t db, uint64_t max_pg)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t i;
+
+	pthread_mutex_lock(&ch->lock);
+	/* the pin table keeps its size, pages are pinned again as they are used */
+	ch->pin_max = max_pg/PIN_DIV;
+	if (ch->pin_max>(ch->pin_mask + 1)/2) {
+		ch->pin_max = (ch->pin_mask + 1)/2;
+	}
+	if (ch->pin_num>ch->pin_max) {
+		unpin_from(db, 0);
+	}
+	if (ch->mode==CACHE_DIRECT) {
+		if (max_pg>ch->pg_num) {
+			add_pages(ch, max_pg - ch->pg_num);
+		}
+		for (i=ch->frame_num; i<max_pg; i++) {
+			ch->pgs[i]->flags &= ~PG_RETIRED;
+		}
+		for (i=max_pg; i<ch->frame_num; i++) {
+			retire_frame(db, ch->pgs[i]);
+		}
+		ch->frame_num = max_pg;
+		ch->hand = ch->hand<max_pg ? ch->hand : 0;
+		ch->max_pg = max_pg;
+	} else {
+		if (2*max_pg>ch->pg_num) {
+			add_pages(ch, 2*max_pg - ch->pg_num);
+		}
+		ch->max_pg = max_pg;
+		evict_free_pages(db, max_pg);
+	}
+	pthread_mutex_unlock(&ch->lock);
+}
+
+static int cmp_gpid(const void *a, const void *b)
+{
+	gpid_t x = (*(struct pg_s **)a)->gpid;
+	gpid_t y = (*(struct pg_s **)b)->gpid;
+
+	return x<y ? -1 : (x>y ? 1 : 0);
+}
+
+/*
+ * flush_dirty_pages() -- one round of the flusher. It takes up to FLUSH_BATCH
+ * dirty pages which are not busy from the cold end of the lru, sorts them by
+ * gpid and writes every run of adjacent pages at once. It is called and
+ * returns with ch->lock held but does the writes without it, the pages
+ * carry PG_WRITEBACK meanwhile so that nobody evicts them, and are latched
+ * shared so that nobody changes them while they are written, a page somebody
+ * has latched is left for the next round. Return the number of pages written.
+ */
+static int flush_dirty_pages(kvdb_t db)
+{
+	struct cache_s *ch = db->ch;
+	struct node_s *heads[2] = { &ch->free, &ch->hot };
+	struct pg_s *v[FLUSH_BATCH];
+	struct node_s *n;
+	struct pg_s *p;
+	int i, j, num = 0;
+
+	for (i=0; i<2; i++) {
+		for (n=heads[i]->prev; n!=heads[i] && num<FLUSH_BATCH; n=n->prev) {
+			p = link_pg(n);
+			if ((p->flags & (PG_DIRTY|PG_WRITEBACK)) == PG_DIRTY
+				&& latch_page_try(db, p, 0)==0) {
+				p->flags &= ~PG_DIRTY;
+				p->flags |= PG_WRITEBACK;
+				ch->dirty_num --;
+				v[num++] = p;
+			}
+		}
+	}
+	/* pinned pages are never free */
+	for (n=ch->busy.next; n!=&ch->busy && num<FLUSH_BATCH; n=n->next) {
+		p = link_pg(n);
+		if ((p->flags & (PG_PINNED|PG_DIRTY|PG_WRITEBACK)) == (PG_PINNED|PG_DIRTY)
+			&& latch_page_try(db, p, 0)==0) {
+			p->flags &= ~PG_DIRTY;
+			p->flags |= PG_WRITEBACK;
+			ch->dirty_num --;
+			v[num++] = p;
+		}
+	}
+	if (num==0)
+		return 0;
+	pthread_mutex_unlock(&ch->lock);
+
+	qsort(v, num, sizeof(v[0]), cmp_gpid);
+	for (i=0; i<num; i=j) {
+		for (j=i+1; j<num && v[j]->gpid==v[j-1]->gpid+1
+			&& (v[j]->flags & PG_MAPPED)==(v[i]->flags & PG_MAPPED); j++)
+			;
+		write_run(db, &v[i], j-i);
+	}
+
+	pthread_mutex_lock(&ch->lock);
+	for (i=0; i<num; i++) {
+		unlatch_page(db, v[i]);
+		v[i]->flags &= ~PG_WRITEBACK;
+		if ((v[i]->flags & PG_RETIRED) && v[i]->ref==0) {
+			retire_frame(db, v[i]);
+		}
+	}
+	return num;
+}
+
+static void *flusher_main(void *arg)
+{
+	kvdb_t db = (kvdb_t)arg;
+	struct cache_s *ch = db->ch;
+	struct timespec ts;
+	int idle = 0;
+
+	pthread_mutex_lock(&ch->lock);
+	while (!ch->flusher_stop) {
+		/* 
+		 * wait after a round which wrote nothing too, the dirty pages are all
+		 * busy then, and their holders need ch->lock to get on
+		 */
+		if (ch->dirty_num<DIRTY_LOW_PG(ch) || idle) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += FLUSH_INTERVAL;
+			pthread_cond_timedwait(&ch->flush_cond, &ch->lock, &ts);
+			if (ch->flusher_stop)
+				break;
+		}
+		idle = (flush_dirty_pages(db)==0);
+		ch->flush_round ++;
+		pthread_cond_broadcast(&ch->clean_cond);
+	}
+	pthread_mutex_unlock(&ch->lock);
+	return NULL;
 }
 
 void exit_cache(kvdb_t db)
 {
+	struct slab_s *sl;
 	struct pg_s *p;
+	uint64_t i;
+
+	pthread_mutex_lock(&db->ch->lock);
+	db->ch->flusher_stop = 1;
+	pthread_cond_signal(&db->ch->flush_cond);
+	pthread_mutex_unlock(&db->ch->lock);
+	pthread_join(db->ch->flusher, NULL);
 
 	while(!list_empty(&db->ch->free)) {
 		p = link_pg(db->ch->free.next);
 		evict_page(db, p);
 	}
+	while(!list_empty(&db->ch->hot)) {
+		p = link_pg(db->ch->hot.next);
+		evict_page(db, p);
+	}
 	while(!list_empty(&db->ch->busy)) {
-		p = link_pg(db->ch->free.next);
+		p = link_pg(db->ch->busy.next);
 		evict_page(db, p);
 	}
+	if (db->ch->area!=NULL) {
+		munmap(db->ch->area, db->ch->area_len);
+	}
+	while ((sl=db->ch->slabs)!=NULL) {
+		db->ch->slabs = sl->next;
+		for (i=0; i<sl->num; i++) {
+			pthread_rwlock_destroy(&sl->pgs[i].latch);
+		}
+		if (sl->frames!=NULL) {
+			munmap(sl->frames, sl->num * PAGE_SIZE);
+		}
+		free(sl->pgs);
+		free(sl);
+	}
+	free(db->ch->pgs);
+	free(db->ch->slots);
+	free(db->ch->pins);
+	free(db->ch->versions);
+	pthread_mutex_destroy(&db->ch->lock);
+	pthread_cond_destroy(&db->ch->flush_cond);
+	pthread_cond_destroy(&db->ch->clean_cond);
 	free(db->ch);
 	db->ch = NULL;
 }
 
-uint32_t pg_hash(gpid_t gpid)
-{
-	uint32_t a, b, c;
-	a = (uint32_t)gpid;
-	b = (uint32_t)(gpid>>22);
-	c = (uint32_t)(gpid>>44);
-	return (uint32_t)((a^b^c) & PAGE_HASH_MASK);
-}
-
-struct pg_s *find_page(kvdb_t db, gpid_t gpid, uint32_t bucket)
+/* take one more pin on a page which has one already, without ch->lock */
+static int get_pinned(struct pg_s *p)
 {
-	struct node_s *head, *n;
-	struct pg_s *p;
+	uint32_t r = __atomic_load_n(&p->ref, __ATOMIC_RELAXED);
 
-	head = &db->ch->hash[bucket]; 
-	for (n=head->next; n!=head; n=n->next) {
-		p = hash_pg(n);
-		if (p->gpid == gpid)
-			return p;
+	while (r>0) {
+		if (__atomic_compare_exchange_n(&p->ref, &r, r + 1, 0, 
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
 	}
-	return NULL;
+	return 0;
 }
 
 pg_t get_page(kvdb_t db, gpid_t gpid)
 {
-	uint32_t bucket;
 	struct pg_s *p;
-	//evict half pages while mapped_num >= MAX_MAPPED_PG
-	if (db->ch->mapped_num >= MAX_MAPPED_PG) {
-		while (!list_empty(&db->ch->free)
-			&& db->ch->mapped_num >= (MAX_MAPPED_PG/2)) {
-			p = link_pg(db->ch->free.prev);
-			evict_page(db, p);
+
+	p = find_pinned(db->ch, gpid);
+	if (p!=NULL && get_pinned(p)) {
+		if (p->gpid==gpid) {
+			stat_add(db, STAT_CACHE_HIT, 1);
+			return p;
 		}
+		put_page(db, p);
 	}
 
-	bucket = pg_hash(gpid);
-	p = find_page(db, gpid, bucket);
+	pthread_mutex_lock(&db->ch->lock);
+	p = find_page(db->ch, gpid);
 	if (p!=NULL) {
-		kvdb_assert((p->flags & PG_BUSY) == 0);
-
-		list_del(&p->link);
-		list_add(&p->link, &db->ch->busy);
-		db->ch->free_num --;
+		stat_add(db, STAT_CACHE_HIT, 1);
+		if (p->ref==0) {
+			list_del(&p->link);
+			list_add(&p->link, &db->ch->busy);
+			db->ch->free_num --;
+			db->ch->hot_num -= (p->flags & PG_HOT) ? 1 : 0;
+			db->ch->busy_num ++;
+		}
+		db->ch->hot_pg += (p->flags & PG_HOT) ? 0 : 1;
+		p->flags |= PG_REF|PG_HOT;
 	} else {
-		uint64_t pos;
-
-		p = malloc(sizeof(*p));
-		kvdb_assert(p!=NULL);
-		p->flags = 0;
-		p->gpid = gpid;
-		pos = get_page_pos(gpid);
-		p->buf = (struct page_s *)mmap(NULL, PAGE_SIZE, 
-						PROT_READ|PROT_WRITE, 
-						MAP_SHARED, 
-						db->fd, pos);
-		kvdb_assert(p->buf!=NULL);
-		list_add(&p->hash, &db->ch->hash[bucket]);
+		stat_add(db, STAT_CACHE_MISS, 1);
+		if (db->ch->mode==CACHE_DIRECT) {
+			p = clock_victim(db);
+			p->flags = 0;
+			p->gpid = gpid;
+			read_page(db, p);
+		} else {
+			if (db->ch->mapped_num>=db->ch->max_pg) {
+				evict_free_pages(db, db->ch->max_pg - EVICT_NUM);
+			}
+			/* all the others are pinned or under writeback */
+			kvdb_assert(!list_empty(&db->ch->spare));
+			p = link_pg(db->ch->spare.next);
+			list_del(&p->link);
+			p->flags = 0;
+			p->gpid = gpid;
+			map_page(db, p);
+		}
+		p->ref = 0;
+		insert_page(db->ch, p);
 		list_add(&p->link, &db->ch->busy);
 		db->ch->mapped_num ++;
+		db->ch->busy_num ++;
 	}
-	kvdb_assert((p->flags & PG_BUSY) == 0);
-	p->flags |= PG_BUSY;
-	db->ch->busy_num ++;
+	__atomic_add_fetch(&p->ref, 1, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&db->ch->lock);
 
 	return p;
 }
 
-void put_page(kvdb_t db, pg_t p)
+/* the last pin on a page is gone, with ch->lock held */
+static void release_page(kvdb_t db, struct pg_s *p)
 {
-	kvdb_assert((p->flags & PG_BUSY) != 0);
 	list_del(&p->link);
-	list_add(&p->link, &db->ch->free);
-	p->flags &= ~PG_BUSY;
+	if (p->flags & PG_HOT) {
+		list_add(&p->link, &db->ch->hot);
+		db->ch->hot_num ++;
+	} else {
+		list_add(&p->link, &db->ch->free);
+	}
 	db->ch->free_num ++;
 	db->ch->busy_num --;
+	if (p->flags & PG_RETIRED) {
+		retire_frame(db, p);
+	}
+}
+
+void put_page(kvdb_t db, pg_t p)
+{
+	uint32_t r = __atomic_load_n(&p->ref, __ATOMIC_RELAXED);
+
+	while (r>1) {
+		if (__atomic_compare_exchange_n(&p->ref, &r, r - 1, 0, 
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+	pthread_mutex_lock(&db->ch->lock);
+	kvdb_assert(p->ref>0);
+	if (__atomic_sub_fetch(&p->ref, 1, __ATOMIC_RELEASE)==0) {
+		release_page(db, p);
+	}
+	pthread_mutex_unlock(&db->ch->lock);
+}
+
+/*
+ * pin_page() -- keep a branch page pinned for good, if the budget allows. It
+ * is called with the page latched.
+ */
+void pin_page(kvdb_t db, pg_t pg)
+{
+	struct cache_s *ch = db->ch;
+
+	if (pg->flags & PG_PINNED)
+		return;
+	pthread_mutex_lock(&ch->lock);
+	if ((pg->flags & PG_PINNED)==0 && ch->pin_num<ch->pin_max) {
+		pg->flags |= PG_PINNED;
+		__atomic_add_fetch(&pg->ref, 1, __ATOMIC_RELAXED);
+		insert_pinned(ch, pg);
+		ch->pin_num ++;
+	}
+	pthread_mutex_unlock(&ch->lock);
+}
+
+/* with ch->lock held */
+static void unpin(kvdb_t db, struct pg_s *p)
+{
+	remove_pinned(db->ch, p);
+	p->flags &= ~PG_PINNED;
+	db->ch->pin_num --;
+	if (__atomic_sub_fetch(&p->ref, 1, __ATOMIC_RELEASE)==0) {
+		release_page(db, p);
+	}
+}
+
+/* unpin all pages from gpid on, with ch->lock held */
+static void unpin_from(kvdb_t db, gpid_t gpid)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t i;
+
+	for (i=0; i<=ch->pin_mask; ) {
+		/* a removal moves a later entry into slot i */
+		if (ch->pins[i].p!=NULL && ch->pins[i].gpid>=gpid) {
+			unpin(db, ch->pins[i].p);
+		} else {
+			i ++;
+		}
+	}
+}
+
+/* unpin a page which has been freed */
+void unpin_page(kvdb_t db, gpid_t gpid)
+{
+	struct cache_s *ch = db->ch;
+	struct pg_s *p;
+
+	if (find_pinned(ch, gpid)==NULL)
+		return;
+	pthread_mutex_lock(&ch->lock);
+	p = find_pinned(ch, gpid);
+	if (p!=NULL) {
+		unpin(db, p);
+	}
+	pthread_mutex_unlock(&ch->lock);
+}
+
+/*
+ * latch_page() -- latch a pinned page shared or exclusively. Latches are 
+ * always taken from the root downwards and from left to right among pages 
+ * of the same level, which is what keeps the tree free of deadlocks.
+ *
+ * A page is latched exclusively to be changed, so its image is logged first
+ * if it has not been since the last checkpoint, see log_page(). Optimistic
+ * readers do not wait for the log, the version is bumped after it.
+ */
+void latch_page(kvdb_t db, pg_t pg, int excl)
+{
+	int ret;
+
+	if (excl) {
+		ret = pthread_rwlock_wrlock(&pg->latch);
+		log_page(db, get_page_pos(pg->gpid), pg->buf);
+		pg->wlatched = 1;
+		__atomic_add_fetch(&db->ch->versions[pg->gpid & VER_STRIPE_MASK], 
+				1, __ATOMIC_SEQ_CST);
+	} else {
+		ret = pthread_rwlock_rdlock(&pg->latch);
+	}
+	kvdb_assert(ret==0);
+}
+
+void unlatch_page(kvdb_t db, pg_t pg)
+{
+	if (pg->wlatched) {
+		pg->wlatched = 0;
+		__atomic_add_fetch(&db->ch->versions[pg->gpid & VER_STRIPE_MASK], 
+				VER_ONE - 1, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&pg->latch);
+}
+
+/* latch a pinned page like latch_page() if nobody holds it, return -1 if not */
+int latch_page_try(kvdb_t db, pg_t pg, int excl)
+{
+	int ret;
+
+	if (excl) {
+		ret = pthread_rwlock_trywrlock(&pg->latch);
+		if (ret==0) {
+			log_page(db, get_page_pos(pg->gpid), pg->buf);
+			pg->wlatched = 1;
+			__atomic_add_fetch(&db->ch->versions[pg->gpid & VER_STRIPE_MASK], 
+					1, __ATOMIC_SEQ_CST);
+		}
+	} else {
+		ret = pthread_rwlock_tryrdlock(&pg->latch);
+	}
+	return ret==0 ? 0 : -1;
+}
+
+/*
+ * peek_page() -- the page for an optimistic reader, NULL if it could not be
+ * read that way and must be pinned and latched as usual.
+ */
+struct page_s *peek_page(kvdb_t db, gpid_t gpid)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t off;
+
+	if (ch->mode!=CACHE_MMAP_AREA) {
+		return NULL;
+	}
+	off = get_page_pos(gpid) - FILE_META_LEN;
+	if (off + PAGE_SIZE > __atomic_load_n(&ch->area_mapped, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return (struct page_s *)(ch->area + off);
+}
+
+/*
+ * prefetch_run() -- ask the kernel to read n pages from gpid on ahead, with
+ * one large read. Only pages read through the page cache of the kernel could
+ * be, the frames of CACHE_DIRECT mode are only filled on demand.
+ */
+void prefetch_run(kvdb_t db, gpid_t gpid, uint64_t n)
+{
+	struct cache_s *ch = db->ch;
+	uint64_t off, mapped;
+
+	if (ch->mode==CACHE_MMAP_AREA) {
+		off = get_page_pos(gpid) - FILE_META_LEN;
+		mapped = __atomic_load_n(&ch->area_mapped, __ATOMIC_ACQUIRE);
+		if (off>=mapped) {
+			return;
+		}
+		if (off + n*PAGE_SIZE > mapped) {
+			n = (mapped - off) / PAGE_SIZE;
+		}
+		madvise(ch->area + off, n*PAGE_SIZE, MADV_WILLNEED);
+	} else if (ch->mode==CACHE_MMAP_PAGE) {
+		posix_fadvise(db->fd, get_page_pos(gpid), n*PAGE_SIZE, POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+ * prefetch_pages() -- ask the kernel to read n pages ahead, so that the 
+ * faults of a batch of lookups overlap. Pages next to each other are asked
+ * for together.
+ */
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x<y ? -1 : (x>y ? 1 : 0);
+}
+
+void prefetch_pages(kvdb_t db, gpid_t *gpid, int n)
+{
+	gpid_t g[n];
+	int i, j;
+
+	memcpy(g, gpid, n * sizeof(gpid_t));
+	qsort(g, n, sizeof(gpid_t), cmp_u64);
+	for (i=0; i<n; i=j) {
+		for (j=i+1; j<n && g[j]<=g[j-1]+1; j++)
+			;
+		prefetch_run(db, g[i], g[j-1] - g[i] + 1);
+	}
+}
+
+/*
+ * page_version() -- version of a page before reading it optimistically, 
+ * VER_LOCKED if somebody is changing it.
+ */
+uint64_t page_version(kvdb_t db, gpid_t gpid)
+{
+	uint64_t v;
+
+	v = __atomic_load_n(&db->ch->versions[gpid & VER_STRIPE_MASK], __ATOMIC_ACQUIRE);
+	return (v & VER_WRITERS) ? VER_LOCKED : v;
+}
+
+/* whether what has been read from the page since page_version() is valid */
+int page_validate(kvdb_t db, gpid_t gpid, uint64_t v)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&db->ch->versions[gpid & VER_STRIPE_MASK], 
+				__ATOMIC_RELAXED) == v;
 }
 
 struct page_s *get_page_buf(kvdb_t db, pg_t pg)
@@ -286,9 +1402,34 @@ struct page_s *get_page_buf(kvdb_t db, pg_t pg)
 	return pg->buf;
 }
 
+gpid_t get_page_gpid(kvdb_t db, pg_t pg)
+{
+	return pg->gpid;
+}
+
+/*
+ * mark_page_dirty() -- a writer which finds DIRTY_HIGH_PG pages dirty waits 
+ * for one round of the flusher, so the dirty part of the cache stays bounded
+ * without making writers wait for each others' pages.
+ */
 void mark_page_dirty(kvdb_t db, pg_t pg)
 {
-	pg->flags |= PG_DIRTY;
+	struct cache_s *ch = db->ch;
+	uint64_t round;
+
+	pthread_mutex_lock(&ch->lock);
+	if ((pg->flags & PG_DIRTY) == 0) {
+		pg->flags |= PG_DIRTY;
+		ch->dirty_num ++;
+		if (ch->dirty_num>=DIRTY_LOW_PG(ch)) {
+			pthread_cond_signal(&ch->flush_cond);
+		}
+		round = ch->flush_round;
+		while (ch->dirty_num>=DIRTY_HIGH_PG(ch) && round==ch->flush_round) {
+			pthread_cond_wait(&ch->clean_cond, &ch->lock);
+		}
+	}
+	pthread_mutex_unlock(&ch->lock);
 }
 
 
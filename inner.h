@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "kvdb.h"
 
 #define PAGE_SIZE		4096ULL  //4kb per page
@@ -37,6 +38,7 @@ struct record_s {
 };
 
 #define PAGE_LEAF	(1<<0)
+#define PAGE_KV		(1<<1)	// keys and values in two arrays, KVDB_FORMAT_KV
 
 struct page_header_s {
 	int32_t  record_num;
@@ -44,11 +46,51 @@ struct page_header_s {
 	gpid_t   next;
 };
 
+/*
+ * All keys of a page are kept together ahead of all the values, or child 
+ * gpids in a branch page, so that a search only touches cache lines of keys.
+ * Pages of KVDB_FORMAT_REC files hold an array of struct record_s instead.
+ */
 struct page_s {
 	struct page_header_s h;
-	struct record_s      rec[RECORD_NUM_PG];
+	uint64_t             k[RECORD_NUM_PG];
+	uint64_t             v[RECORD_NUM_PG];
 };
 
+#define KVDB_FORMAT_REC		0	// records of key and value interleaved
+#define KVDB_FORMAT_KV		1	// see struct page_s
+#define KVDB_FORMAT_COMPACT	2	// branch pages may be struct branch_s
+
+#define PAGE_COMPACT	(1<<2)	// a branch page encoded as struct branch_s, KVDB_FORMAT_COMPACT
+
+/* a compact branch page, see branch.c */
+#define BRANCH_NUM_PG	((PAGE_SIZE - 32) / 8)
+
+struct branch_s {
+	struct page_header_s h;
+	uint64_t base;			// key i is base + (dk[i] << shift)
+	uint32_t shift;
+	uint32_t reserve;
+	uint32_t dk[BRANCH_NUM_PG];
+	uint32_t c[BRANCH_NUM_PG];	// child gpids
+};
+
+static inline uint64_t br_key(struct page_s *p, int i)
+{
+	struct branch_s *b = (struct branch_s *)p;
+
+	if (p->h.flags & PAGE_COMPACT)
+		return b->base + ((uint64_t)b->dk[i] << (b->shift & 63));
+	return p->k[i];
+}
+
+static inline gpid_t br_child(struct page_s *p, int i)
+{
+	if (p->h.flags & PAGE_COMPACT)
+		return ((struct branch_s *)p)->c[i];
+	return p->v[i];
+}
+
 struct file_header_s {
 	uint64_t magic;
 	uint64_t file_size;
@@ -56,8 +98,9 @@ struct file_header_s {
 	uint64_t total_pages;
 	uint64_t spare_pages;
 	uint32_t level;
-	uint32_t reserve;
+	uint32_t format;	// KVDB_FORMAT_*
 	gpid_t   root_gpid;
+	uint64_t used_size;	// the file is in use below it, see file_allocate()
 };
 
 struct page_bitmap_s {
@@ -68,26 +111,83 @@ struct busy_page_num_s {
 	uint32_t n[MAX_CHUNK_NUM];
 };
 
+#define LOG_PUT		1
+#define LOG_DEL		2
+#define LOG_DEL_RANGE	3	// k to v, not including v
+#define LOG_PAGE	4	// image of the page at position k, v its crc, see log.c
+
+struct log_rec_s {
+	uint64_t lsn;
+	uint32_t op;		// LOG_PUT, LOG_DEL, LOG_DEL_RANGE or LOG_PAGE
+	uint32_t reserve;
+	uint64_t k;
+	uint64_t v;
+	uint64_t crc;		// kv_crc64() of all the fields above
+};
+
 struct allocator_s;
 struct cache_s;
+struct log_s;
+
+/* how the page cache reaches the data area of the file, KVDB_CACHE_* - 1 */
+#define CACHE_MMAP_PAGE		0	// mmap()/munmap() every page on its own
+#define CACHE_MMAP_AREA		1	// map the data area once, grow it in place
+#define CACHE_DIRECT		2	// own frames, pread()/pwrite() with O_DIRECT
+#ifndef CACHE_MODE_DEFAULT
+#define CACHE_MODE_DEFAULT	CACHE_MMAP_AREA
+#endif
+
+/* bytes of pages the cache keeps unless kvdb_open_ex() is told otherwise */
+#ifndef CACHE_SIZE_DEFAULT
+#define CACHE_SIZE_DEFAULT	(64*1024*1024ULL)
+#endif
+#define CACHE_MIN_PG		(64)	// room for the pages pinned at once
+
+/* how the file grows, see file_allocate() */
+#ifndef FILE_GROW_STEP
+#define FILE_GROW_STEP		0	// bytes at a time, 0 for a quarter of it
+#endif
+#define FILE_GROW_MIN		(4*1024*1024ULL)
+#define FILE_GROW_MAX		(1024*1024*1024ULL)
 
 struct pg_s;
 typedef struct pg_s *pg_t;
 
+struct stats_s;
+
 struct kvdb_s {
 	int fd;
+	int cache_mode;
+	uint64_t cache_pg;		// pages the cache keeps when it is opened
 	struct file_header_s *h;
 	struct allocator_s *alc;
 	struct cache_s *ch;
+	struct log_s *lg;
+	pthread_rwlock_t lock;		// shared by writers, exclusive for checkpoints
+	pthread_rwlock_t root_latch;	// protects root_gpid and level
+	int mget_cold;			// kvdb_multi_get() met major faults, atomic
+	uint64_t stats_id;		// unique for every kvdb_open()
+	struct stats_s *stats;		// counters of each thread
+	pthread_mutex_t stats_lock;	// protects the list of stats
 };
 
+/* a cursor holds no latch between the calls, pg and p are NULL then */
 struct cursor_s {
-	gpid_t	gpid;
+	gpid_t	gpid;		// the leaf of the last record returned
 	pg_t    pg;
 	struct  page_s *p;
 	int	pos;
 	uint64_t start_key;
 	uint64_t end_key;
+	uint64_t next_key;	// the next call looks from it on
+	uint64_t ver;		// version of the leaf when it was let go
+	struct record_s *rec;	// records of the leaf from pos on, copied then
+	int	rec_num;
+	gpid_t	ra_end;		// pages below it have been read ahead
+	int	ra_win;		// pages to read ahead, 0 if not sequential
+	int	ra_hops;	// leaves since the faults were counted
+	int	ra_cold;	// the scan meets major faults
+	long	ra_flt;
 };
 
 /* allocator */
@@ -95,21 +195,120 @@ void init_allocator(kvdb_t db);
 void exit_allocator(kvdb_t db);
 void sync_allocator(kvdb_t db);
 gpid_t alloc_page(kvdb_t db);
+gpid_t alloc_pages(kvdb_t db, uint32_t n);
+gpid_t alloc_page_near(kvdb_t db, gpid_t hint);
+void release_extents(kvdb_t db);
 void free_page(kvdb_t db, gpid_t pg);
 void file_allocate(kvdb_t db, uint64_t pos, uint64_t len);
 uint64_t get_page_pos(gpid_t gpid);
+gpid_t last_used_page(kvdb_t db, gpid_t below);
+gpid_t alloc_page_below(kvdb_t db, gpid_t limit);
+gpid_t file_end_page(kvdb_t db);
+void cut_file(kvdb_t db, gpid_t end);
+uint64_t punch_free_pages(kvdb_t db);
+void clear_allocator(kvdb_t db);
+void mark_page_used(kvdb_t db, gpid_t gpid);
 
 /* cache */
 void init_cache(kvdb_t db); 
 void exit_cache(kvdb_t db);
+void grow_cache_area(kvdb_t db, uint64_t file_size);
+void shrink_cache_area(kvdb_t db, uint64_t file_size);
+void resize_cache(kvdb_t db, uint64_t max_pg);
+gpid_t discard_pages(kvdb_t db, gpid_t gpid);
 
 pg_t get_page(kvdb_t db, gpid_t gpid);
 void put_page(kvdb_t db, pg_t pg);
+void pin_page(kvdb_t db, pg_t pg);
+void unpin_page(kvdb_t db, gpid_t gpid);
 struct page_s *get_page_buf(kvdb_t db, pg_t pg);
+gpid_t get_page_gpid(kvdb_t db, pg_t pg);
 void mark_page_dirty(kvdb_t db, pg_t pg);
+void latch_page(kvdb_t db, pg_t pg, int excl);
+int latch_page_try(kvdb_t db, pg_t pg, int excl);
+void unlatch_page(kvdb_t db, pg_t pg);
+
+#define VER_LOCKED	((uint64_t)-1)
+struct page_s *peek_page(kvdb_t db, gpid_t gpid);
+void prefetch_run(kvdb_t db, gpid_t gpid, uint64_t n);
+void prefetch_pages(kvdb_t db, gpid_t *gpid, int n);
+uint64_t page_version(kvdb_t db, gpid_t gpid);
+int page_validate(kvdb_t db, gpid_t gpid, uint64_t v);
 
 void sync_all_page(kvdb_t db);
 
+/* log */
+void init_log(kvdb_t db, const char *name);
+void exit_log(kvdb_t db);
+int log_is_empty(kvdb_t db);
+uint64_t restore_pages(kvdb_t db);
+uint64_t replay_log(kvdb_t db, void (*fn)(kvdb_t, struct log_rec_s *));
+uint64_t log_append(kvdb_t db, uint32_t op, uint64_t k, uint64_t v);
+void log_page(kvdb_t db, uint64_t pos, const void *buf);
+void log_new_pages(kvdb_t db, uint64_t pos, uint32_t n);
+void log_commit(kvdb_t db, uint64_t lsn);
+int log_need_checkpoint(kvdb_t db);
+void reset_log(kvdb_t db);
+
+/* search */
+extern int (*count_keys_le)(const uint64_t *keys, int n, uint64_t k);
+extern int (*count_keys32_le)(const uint32_t *keys, int n, uint32_t k);
+void init_search(void);
+
+/* branch */
+uint64_t br_sep(uint64_t lo, uint64_t hi);
+int br_room(struct page_s *p);
+int br_find(struct page_s *p, uint64_t k);
+void br_init(struct page_s *p, uint64_t k, gpid_t child);
+int br_compact(struct page_s *p);
+int br_insert(struct page_s *p, int pos, uint64_t k, gpid_t child, uint64_t low);
+void br_delete(struct page_s *p, int pos);
+int br_set_key(struct page_s *p, int pos, uint64_t k);
+void br_set_child(struct page_s *p, int pos, gpid_t child);
+int br_merge(struct page_s *l, struct page_s *r, uint64_t sep);
+int br_balance(struct page_s *l, struct page_s *r, uint64_t sep, int m);
+uint64_t br_split(struct page_s *p, struct page_s *np, int half);
+
+/* tree */
+uint64_t free_tree(kvdb_t db, gpid_t gpid);
+
+/* bulk */
+void bulk_load(kvdb_t db, int (*next)(void *, uint64_t *, uint64_t *), void *arg,
+		int fill, void (*put)(kvdb_t, uint64_t, uint64_t));
+
+/* stats, counters added up by kvdb_get_stats() */
+#define STAT_CACHE_HIT		0
+#define STAT_CACHE_MISS		1
+#define STAT_CACHE_EVICT	2
+#define STAT_CACHE_WRITEBACK	3
+#define STAT_MSYNC		4
+#define STAT_MSYNC_BYTES	5
+#define STAT_FSYNC		6
+#define STAT_FALLOCATE		7
+#define STAT_FALLOCATE_BYTES	8
+#define STAT_PWRITE		9
+#define STAT_PWRITE_BYTES	10
+#define STAT_PREAD		11
+#define STAT_PREAD_BYTES	12
+#define STAT_LOG_WRITE		13
+#define STAT_LOG_BYTES		14
+#define STAT_SPLIT		15
+#define STAT_MERGE		16
+#define STAT_PAGE_ALLOC		17
+#define STAT_PAGE_FREE		18
+#define STAT_NUM		19
+
+void init_stats(kvdb_t db);
+void exit_stats(kvdb_t db);
+void stat_add(kvdb_t db, int i, uint64_t n);
+uint64_t stat_begin(kvdb_t db);
+void stat_end(kvdb_t db, int op, uint64_t start);
+void get_cache_stats(kvdb_t db, struct kvdb_stats_s *st);
+uint64_t used_pages(kvdb_t db);
+
+/* crc64 */
+uint64_t kv_crc64(const unsigned char *buffer, uint64_t length);
+
 #endif //__kvdb_inner_h__
 
 
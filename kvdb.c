@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		// RUSAGE_THREAD
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -8,7 +9,9 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
+#include <sys/resource.h>
 
 #include "kvdb.h"
 #include "inner.h"
@@ -23,7 +26,21 @@
 #define REC_INSERTED	5
 #define FOUND_EXACT	6
 #define FOUND_GREATER	7
-
+#define RESTART		8
+
+#define OLC_RETRY	8	// optimistic tries before a search takes latches
+#define MGET_WAVE	64	// lookups kvdb_multi_get() walks down together
+#define RA_MIN		8	// pages a cursor reads ahead at first
+#define RA_MAX		256	// and at most
+#define RA_CHECK	16	// leaves a cursor counts major faults over
+#define MERGE_NUM	(RECORD_NUM_PG/4)	// a page holding no more is thin
+#define MERGE_MAX	(RECORD_NUM_PG*3/4)	// siblings holding no more are merged
+#define COMPACT_BATCH	64	// pages kvdb_compact() moves at a time
+#define COMPACT_PAUSE	1000	// microseconds writers get in between
+#define FIND_WINDOW	32	// keys find_key() counts with a vector kernel
+
+static void redo_rec(kvdb_t d, struct log_rec_s *r);
+static void kvdb_checkpoint(kvdb_t d);
 
 /*
  * TODO: to dump all items in the call stack
@@ -51,7 +68,10 @@ void _kvdb_dump_page(gpid_t gpid, struct page_s *p)
 	fprintf(stderr, "h.flags = %x\n", p->h.flags);
 	fprintf(stderr, "h.next = %lx\n", p->h.next);
 	for (i=0; i<(int)p->h.record_num; i++) {
-		fprintf(stderr, "kv: i=%3d, k=%lu, v=%lu\n", i, p->rec[i].k, p->rec[i].v);
+		if (p->h.flags & PAGE_LEAF)
+			fprintf(stderr, "kv: i=%3d, k=%lu, v=%lu\n", i, p->k[i], p->v[i]);
+		else
+			fprintf(stderr, "kv: i=%3d, k=%lu, v=%lu\n", i, br_key(p, i), br_child(p, i));
 	}
 	fprintf(stderr, "\n");
 }
@@ -83,6 +103,8 @@ void kvdb_dump_head(kvdb_t d)
 	pr(level);
 	pr(total_pages);
 	pr(spare_pages);
+	pr(file_size);
+	pr(used_size);
 #undef pr
 	fprintf(stderr, "\n");
 }
@@ -101,7 +123,7 @@ void kvdb_dump_tree(kvdb_t d, gpid_t gpid)
 	_kvdb_dump_page(gpid, p);
 	if ((p->h.flags & PAGE_LEAF)==0) {
 		for (i=0; i<p->h.record_num; i++) {
-			kvdb_dump_tree(d, p->rec[i].v);
+			kvdb_dump_tree(d, br_child(p, i));
 		}
 	}
 	put_page(d, pg);
@@ -119,17 +141,130 @@ void kvdb_dump(kvdb_t d)
 }
 
 /*
- * open the database
- * TODO: we do not discriminate RDONLY and RDWR now, so may we could do it later.
+ * convert_tree() -- rewrite the pages of a KVDB_FORMAT_REC file with their
+ * keys and values apart. A page is marked with PAGE_KV when it is done, so
+ * an upgrade cut short by a crash goes on where it stopped.
+ */
+static void convert_tree(kvdb_t d, gpid_t gpid)
+{
+	struct record_s rec[RECORD_NUM_PG];
+	struct page_s *p;
+	pg_t pg;
+	int i;
+
+	pg = get_page(d, gpid);
+	p = get_page_buf(d, pg);
+	if ((p->h.flags & PAGE_KV)==0) {
+		memcpy(rec, p->k, sizeof(rec));
+		for (i=0; i<p->h.record_num; i++) {
+			p->k[i] = rec[i].k;
+			p->v[i] = rec[i].v;
+		}
+		p->h.flags |= PAGE_KV;
+		mark_page_dirty(d, pg);
+	}
+	if ((p->h.flags & PAGE_LEAF)==0) {
+		for (i=0; i<p->h.record_num; i++) {
+			convert_tree(d, br_child(p, i));
+		}
+	}
+	put_page(d, pg);
+}
+
+/*
+ * upgrade_format() -- convert a file of an older format to the current one,
+ * the header is only changed after all pages are on disk. Branch pages are
+ * not converted to struct branch_s, but they may be written that way from
+ * now on, so the header says KVDB_FORMAT_COMPACT before any page is written
+ * and older versions refuse the file.
+ */
+static void upgrade_format(kvdb_t d)
+{
+	int ret;
+
+	if (d->h->format<KVDB_FORMAT_KV && d->h->root_gpid!=GPID_NIL) {
+		convert_tree(d, d->h->root_gpid);
+		sync_all_page(d);
+	}
+	d->h->format = KVDB_FORMAT_COMPACT;
+	ret = msync(d->h, FILE_HEADER_LEN, MS_SYNC);
+	kvdb_assert(ret==0);
+}
+
+/* mark the pages of the subtree at gpid used, level is its height */
+static void mark_tree(kvdb_t d, gpid_t gpid, int level)
+{
+	struct page_s *p;
+	pg_t pg;
+	int i;
+
+	mark_page_used(d, gpid);
+	if (level<=1) {
+		return;
+	}
+	pg = get_page(d, gpid);
+	p = get_page_buf(d, pg);
+	for (i=0; i<p->h.record_num; i++) {
+		mark_tree(d, br_child(p, i), level - 1);
+	}
+	put_page(d, pg);
+}
+
+/*
+ * rebuild_allocator() -- after a crash the bitmaps may mark pages which are
+ * in no tree, they reach the disk between checkpoints like the pages do.
+ * Only the pages of the tree are marked used again, the leaves are known
+ * from their parents and not read.
  */
+static void rebuild_allocator(kvdb_t d)
+{
+	clear_allocator(d);
+	if (d->h->root_gpid!=GPID_NIL) {
+		mark_tree(d, d->h->root_gpid, d->h->level);
+	}
+}
+
+/* pages of the cache asked for by opts, or the default */
+static uint64_t cache_pages(const struct kvdb_opts_s *opts)
+{
+	uint64_t size = CACHE_SIZE_DEFAULT;
+
+	if (opts!=NULL && opts->cache_size>0) {
+		size = opts->cache_size;
+	} else if (opts!=NULL && opts->cache_pct>0) {
+		size = (uint64_t)sysconf(_SC_PHYS_PAGES) * (uint64_t)sysconf(_SC_PAGESIZE)
+			/ 100 * opts->cache_pct;
+	}
+	return size/PAGE_SIZE>CACHE_MIN_PG ? size/PAGE_SIZE : CACHE_MIN_PG;
+}
+
+static int cache_mode(const struct kvdb_opts_s *opts)
+{
+	if (opts==NULL || opts->cache_mode==KVDB_CACHE_DEFAULT) {
+		return CACHE_MODE_DEFAULT;
+	}
+	kvdb_assert(opts->cache_mode<=KVDB_CACHE_DIRECT);
+	return opts->cache_mode - 1;
+}
+
 kvdb_t kvdb_open(char *name)
+{
+	return kvdb_open_ex(name, NULL);
+}
+
+/*
+ * open the database, opts may be NULL for the defaults
+ * TODO: we do not discriminate RDONLY and RDWR now, so may we could do it later.
+ */
+kvdb_t kvdb_open_ex(char *name, const struct kvdb_opts_s *opts)
 {
 	int fd;
 	kvdb_t d;
 	struct stat st;
 	int ret;
-	int new = 0;
+	int new = 0, crashed;
 
+	init_search();
 	fd = open(name, O_CREAT|O_RDWR|__O_DIRECT, 0666); //读写，同步新建或打开name
 	if (fd<0) {
 		kvdb_assert(0);		// this failure seems most unlikely happens
@@ -138,6 +273,11 @@ kvdb_t kvdb_open(char *name)
 	d = (kvdb_t)malloc(sizeof(*d));
 	kvdb_assert(d!=NULL);//空间申请失败则终止
 	d->fd = fd;
+	init_stats(d);
+	d->cache_mode = cache_mode(opts);
+	d->cache_pg = cache_pages(opts);
+	d->ch = NULL;
+	init_log(d, name);
 	ret = fstat(d->fd, &st);//将d->fd 所指向的文件状态复制到结构stat中 成功0 失败-1
 	kvdb_assert(ret==0);//文件状态复制失败则终止
 	if (st.st_size<FILE_HEADER_LEN) {
@@ -147,6 +287,12 @@ kvdb_t kvdb_open(char *name)
 			abort();
 		}
 		new = 1;
+		/* a log left without its database file is of no use */
+		reset_log(d);
+	} else if (restore_pages(d)>0) {
+		/* the pages are as of the last checkpoint, some past a cut end */
+		ret = fstat(d->fd, &st);
+		kvdb_assert(ret==0);
 	}
 
 	/* 
@@ -168,12 +314,36 @@ kvdb_t kvdb_open(char *name)
 		d->h->level = 0;
 		d->h->total_pages = 0;
 		d->h->spare_pages = 0;
+		d->h->format = KVDB_FORMAT_COMPACT;
+	}
+	if (d->h->format>KVDB_FORMAT_COMPACT) {
+		fprintf(stderr, "kvdb_open(): unknown format %u of %s\n", 
+				d->h->format, name);
+		kvdb_assert(0);
+		return NULL;
 	}
 
 	d->h->file_size = st.st_size;
+	if (d->h->used_size==0 || d->h->used_size>d->h->file_size) {
+		/* written before used_size was kept */
+		d->h->used_size = st.st_size;
+	}
 
+	pthread_rwlock_init(&d->lock, NULL);
+	pthread_rwlock_init(&d->root_latch, NULL);
+	d->mget_cold = 0;
 	init_allocator(d);
 	init_cache(d);
+	if (d->h->format<KVDB_FORMAT_COMPACT) {
+		upgrade_format(d);
+	}
+	crashed = !log_is_empty(d);
+	if (crashed) {
+		rebuild_allocator(d);
+	}
+	replay_log(d, redo_rec);
+	/* even if nothing was replayed, it logs the image of the header */
+	kvdb_checkpoint(d);
 	return d;
 }
 
@@ -196,12 +366,54 @@ int kvdb_close(kvdb_t db)
 	ret = fsync(db->fd);//同步内存中所有已修改的文件数据到储存设备
 	kvdb_assert(ret==0);
 
+	/* everything is in the database file now */
+	reset_log(db);
+	exit_log(db);
+	pthread_rwlock_destroy(&db->lock);
+	pthread_rwlock_destroy(&db->root_latch);
+
 	ret = close(db->fd);//close为linux系统调用函数
 	kvdb_assert(ret==0);
+	exit_stats(db);
 	
 	return 0;
 }
 
+/*
+ * kvdb_set_cache_size() -- grow or shrink the cache of an open database to 
+ * size bytes of pages, e.g. under memory pressure. Return -1 if it is too 
+ * small to hold the pages pinned at once.
+ */
+int kvdb_set_cache_size(kvdb_t db, uint64_t size)
+{
+	if (size/PAGE_SIZE<CACHE_MIN_PG) {
+		return -1;
+	}
+	resize_cache(db, size/PAGE_SIZE);
+	return 0;
+}
+
+/* pin a page and latch it */
+static pg_t latch_get(kvdb_t d, gpid_t gpid, int excl, struct page_s **p)
+{
+	pg_t pg;
+
+	pg = get_page(d, gpid);
+	latch_page(d, pg, excl);
+	*p = get_page_buf(d, pg);
+	return pg;
+}
+
+/* branch pages stay pinned after the last latch_put(), see pin_page() */
+static void latch_put(kvdb_t d, pg_t pg)
+{
+	if ((get_page_buf(d, pg)->h.flags & PAGE_LEAF)==0) {
+		pin_page(d, pg);
+	}
+	unlatch_page(d, pg);
+	put_page(d, pg);
+}
+
 /* 
  * bpt_make_root(): make the root page of the B+ Tree 
  *
@@ -212,8 +424,11 @@ int kvdb_close(kvdb_t db)
  *    arrived to be inserted into that page, so we should split the 
  *    LEAF page, and it caused the root page full too. we must increase
  *    the level of the tree and create a new root page.
+ *
+ * The new root is returned latched exclusively, holding rec if it is not 
+ * NULL, the caller must hold d->root_latch exclusively.
  */
-static void bpt_make_root(kvdb_t d, int leaf)
+static pg_t bpt_make_root(kvdb_t d, int leaf, struct record_s *rec, struct page_s **rp)
 {
 	struct page_s *p; 
 	pg_t pg;
@@ -222,387 +437,1441 @@ static void bpt_make_root(kvdb_t d, int leaf)
 	gpid = alloc_page(d);//页面分配
 	kvdb_assert(gpid!=GPID_NIL);
 
-	d->h->root_gpid = gpid;
+	pg = latch_get(d, gpid, 1, &p);
+	if (rec!=NULL) {
+		br_init(p, rec->k, (gpid_t)rec->v);
+	} else {
+		p->h.record_num = 0;
+		p->h.flags = PAGE_KV | (leaf ? PAGE_LEAF : 0);
+		p->h.next = GPID_NIL;
+	}
+	mark_page_dirty(d, pg);
+
+	/* optimistic readers may find the page as soon as root_gpid is set */
+	__atomic_store_n(&d->h->root_gpid, gpid, __ATOMIC_RELEASE);
 	d->h->level ++; 
 
-	pg = get_page(d, gpid);
-	p = get_page_buf(d, pg);
-	p->h.record_num = 0;
-	p->h.flags = (leaf ? PAGE_LEAF : 0);
-	p->h.next = GPID_NIL;
-	put_page(d, pg);
+	*rp = p;
+	return pg;
 }
 
 /* 
  * find a key in a page, return the index of the record which
- * rec[index].k == k
- * rec[index].k < k < rec[index+1].k
+ * k[index] == k
+ * k[index] < k < k[index+1]
+ * or -1 if k is less than all of them.
+ *
+ * The binary search is branchless and stops at FIND_WINDOW records, which 
+ * are counted by a vector kernel, see search.c. It must not trust the page,
+ * optimistic readers call it on pages which may be changed under them, see 
+ * bpt_search_olc().
  */
 static int find_key(struct page_s *p, uint64_t k)
 {
-	int mi, lo, hi; 
+	int lo, n, half; 
 
+	if (p->h.flags & PAGE_COMPACT) {
+		return br_find(p, k);
+	}
+	/* keys before lo are not greater than k, keys from lo+n on are */
 	lo = 0; 
-	hi = p->h.record_num - 1;
-
-	if (p->h.record_num<=0 || k<p->rec[lo].k) {
-		return -1;
+	n = p->h.record_num;
+	if ((uint32_t)n > RECORD_NUM_PG) {
+		n = RECORD_NUM_PG;	// torn under an optimistic reader
 	}
-
-	if (k >= p->rec[hi].k) {
-		return hi;
+	while (n > FIND_WINDOW) {
+		half = n / 2;
+		lo = (p->k[lo+half-1] <= k) ? lo + half : lo;
+		n -= half;
 	}
+	return lo + count_keys_le(&p->k[lo], n, k) - 1;
+}
 
-	while (lo <= hi) {
-		mi = (lo + hi) / 2;
-		if (k == p->rec[mi].k) {
-			return mi;
-		}
-		if (k > p->rec[mi].k) {
-			if (k < p->rec[mi+1].k) {
-				return mi;
-			} else {
-				lo = mi + 1;
-			}
-		} else {
-			hi = mi - 1;
-		}
-	}
-	kvdb_assert(0);
-	return -1;
+/* move n records from src->k/v[from] to dst->k/v[to], they may overlap */
+static void move_recs(struct page_s *dst, int to, struct page_s *src, int from, int n)
+{
+	memmove(&dst->k[to], &src->k[from], n * sizeof(uint64_t));
+	memmove(&dst->v[to], &src->v[from], n * sizeof(uint64_t));
 }
 
 /* insert a record into a page */
-static int insert_rec(kvdb_t d, pg_t pg, struct page_s *p, int pos, struct record_s *rec)
+static int leaf_insert(struct page_s *p, int pos, struct record_s *rec)
 {
-	int i;
 	int ret = OK;
 	
 	//fprintf(stderr, "insert_rec(): p=%p, (%s) pos=%d, rec=(%lu, %lu)\n", 
 	//		p, (p->h.flags&PAGE_LEAF ? "leaf" : "branch"), pos, rec->k, rec->v);
 	if (p->h.record_num==0) {
-		p->rec[0].k = rec->k;
-		p->rec[0].v = rec->v;
+		p->k[0] = rec->k;
+		p->v[0] = rec->v;
 		p->h.record_num = 1;
-		mark_page_dirty(d, pg);
 		return  REC_INSERTED;
 	}
 
-	kvdb_assert(p->h.record_num < RECORD_NUM_PG);
+	/* a full page can only have a value replaced */
+	kvdb_assert(p->h.record_num < RECORD_NUM_PG || rec->k == p->k[pos]);
 
-	if (rec->k > p->rec[pos].k) {
-		kvdb_assert(pos == p->h.record_num-1 || p->rec[pos].k < p->rec[pos+1].k);
-		for (i=p->h.record_num; i>pos+1; i--) {
-			p->rec[i].k = p->rec[i-1].k;
-			p->rec[i].v = p->rec[i-1].v;
-		}
-		p->rec[pos+1].k = rec->k;
-		p->rec[pos+1].v = rec->v;
+	if (rec->k > p->k[pos]) {
+		kvdb_assert(pos == p->h.record_num-1 || p->k[pos] < p->k[pos+1]);
+		move_recs(p, pos+2, p, pos+1, p->h.record_num-pos-1);
+		p->k[pos+1] = rec->k;
+		p->v[pos+1] = rec->v;
 		p->h.record_num ++;
 		ret = REC_INSERTED;
-	} else if (rec->k == p->rec[pos].k) {
+	} else if (rec->k == p->k[pos]) {
 		/* If the page is a branch in the tree, its record should not be replaced */
 		kvdb_assert((p->h.flags & PAGE_LEAF) != 0);
 		/* replace the value */
-		p->rec[pos].v = rec->v;
+		p->v[pos] = rec->v;
 		ret = REC_REPLACED;
-	} else if (pos==0 && rec->k<p->rec[pos].k){
-		for (i=p->h.record_num; i>0; i--) {
-			p->rec[i].k = p->rec[i-1].k;
-			p->rec[i].v = p->rec[i-1].v;
-		}
-		p->rec[0].k = rec->k;
-		p->rec[0].v = rec->v;
+	} else if (pos==0 && rec->k<p->k[pos]){
+		move_recs(p, 1, p, 0, p->h.record_num);
+		p->k[0] = rec->k;
+		p->v[0] = rec->v;
 		p->h.record_num ++;
 		ret = REC_INSERTED;
 	} else {
-		/* rec->k should not be less than p->rec[pos].k */
+		/* rec->k should not be less than p->k[pos] */
 		kvdb_assert(0);
 	}
+	return ret;
+}
+
+static int insert_rec(kvdb_t d, pg_t pg, struct page_s *p, int pos, struct record_s *rec)
+{
+	int ret;
+
+	ret = leaf_insert(p, pos, rec);
 	mark_page_dirty(d, pg);
 	return ret;
 }
 
 
+/*
+ * latch_root() -- pin and latch the root page, return NULL if the tree is 
+ * empty. The height of the tree is returned in *level, and the root page is
+ * latched exclusively if the height is not more than excl_level. Holding 
+ * d->root_latch until the root page is latched makes sure it is still the 
+ * root, since the root only changes with its page latched exclusively.
+ */
+static pg_t latch_root(kvdb_t d, int excl_level, struct page_s **p, int *level)
+{
+	pg_t pg = NULL;
+
+	pthread_rwlock_rdlock(&d->root_latch);
+	*level = d->h->level;
+	if (d->h->root_gpid!=GPID_NIL) {
+		pg = latch_get(d, d->h->root_gpid, *level<=excl_level, p);
+	}
+	pthread_rwlock_unlock(&d->root_latch);
+	return pg;
+}
+
+/*
+ * page_full() -- whether a page must be split before a record could be 
+ * inserted into it. force is set if inserting into it has failed already,
+ * see br_insert().
+ */
+static int page_full(kvdb_t d, pg_t pg, struct page_s *p, int force)
+{
+	if (p->h.flags & PAGE_LEAF) {
+		return p->h.record_num>=RECORD_NUM_PG;
+	}
+	if (force && p->h.record_num>=2) {
+		return 1;
+	}
+	if (br_room(p)) {
+		return 0;
+	}
+	/* a wide page may take more records once encoded compact */
+	if (br_compact(p)==0) {
+		mark_page_dirty(d, pg);
+		return 0;
+	}
+	return 1;
+}
+
 /* 
- * split current page into two pages and insert a record which pointer to the new one 
- * into parent page. This function may be the most complex in the kvdb, so make sure 
- * you have understood it before you try to change it.
+ * split current page into two pages and insert a record which pointer to the
+ * new one into parent page, or return NULL if the parent page could not take
+ * it. This function may be the most complex in the kvdb, so make sure you
+ * have understood it before you try to change it.
+ *
+ * The parent and the current page must be latched exclusively, the new page is 
+ * returned latched exclusively too, so that the caller could go on with either half,
+ * keys not less than *sep belong to the new one.
  */
-static void bpt_split(kvdb_t d, pg_t ppg, struct page_s *parent, int _ppos, struct page_s *curr)
+static pg_t bpt_split(kvdb_t d, pg_t ppg, struct page_s *parent, int ppos, 
+		pg_t cpg, struct page_s *curr, struct page_s **newp, uint64_t *sep)
 {
 	struct page_s *p; 
 	gpid_t new_gpid;
-	pg_t pg, up_pg;
-	struct page_s *up = parent;
-	int need_to_put = 0;
-	int i, j;
-	int ppos = _ppos;
+	pg_t pg;
 	int half; 
-	struct record_s rec;
+	uint64_t s, low;
 
-	/* If the current page is root, then we make a new root page and
-	 * reduce the old root to be a inferior to the new one as a leaf.
-	 */
-	if (parent==NULL) {
-		rec.k = curr->rec[0].k;
-		rec.v = d->h->root_gpid;
-
-		bpt_make_root(d, 0);
-		up_pg = get_page(d, d->h->root_gpid);
-		up = get_page_buf(d, up_pg);
-		insert_rec(d, up_pg, up, -1, &rec);
-		need_to_put = 1;
-		ppos = 0;
+	half = curr->h.record_num/2;
+	if (curr->h.flags & PAGE_LEAF) {
+		s = br_sep(curr->k[half-1], curr->k[half]);
+		low = curr->k[0];
 	} else {
-		up_pg = ppg;
-		up = parent;
+		s = br_key(curr, half);
+		low = br_key(curr, 0);
 	}
-	
+
 	/*
-	 * allocate a new page and copy the last half records in the current page to 
-	 * the new one.
+	 * allocate a new page and insert the record which points to it into the 
+	 * parent page first, nobody could get into the new page before it is 
+	 * filled since it is latched. 
+	 *
+	 * keys less than the first one of a branch page are looked for in its first 
+	 * child, so that child may hold keys below it. br_insert() keeps the first 
+	 * key the lowest one when the first child is split. The new page goes next
+	 * to the current one on disk if it could, see alloc_page_near().
 	 */
-	new_gpid = alloc_page(d);
-	pg = get_page(d, new_gpid);
-	p = get_page_buf(d, pg);
-	
-	half = curr->h.record_num/2;
-	for (i=half; i<curr->h.record_num; i++) {
-		j = i - half;
-		p->rec[j].k = curr->rec[i].k;
-		p->rec[j].v = curr->rec[i].v;
+	new_gpid = alloc_page_near(d, get_page_gpid(d, cpg));
+	pg = latch_get(d, new_gpid, 1, &p);
+	if (br_insert(parent, ppos, s, new_gpid, low)!=0) {
+		latch_put(d, pg);
+		free_page(d, new_gpid);
+		return NULL;
 	}
+	mark_page_dirty(d, ppg);
+
+	/* copy the last half records in the current page to the new one */
 	p->h.flags = curr->h.flags;
 	p->h.next = curr->h.next;
-	p->h.record_num = curr->h.record_num - half;
-	curr->h.record_num = half;
+	if (curr->h.flags & PAGE_LEAF) {
+		move_recs(p, 0, curr, half, curr->h.record_num - half);
+		p->h.record_num = curr->h.record_num - half;
+		curr->h.record_num = half;
+	} else {
+		br_split(curr, p, half);
+	}
 	curr->h.next = new_gpid;
+	mark_page_dirty(d, pg);
+	mark_page_dirty(d, cpg);
+	stat_add(d, STAT_SPLIT, 1);
 
-	/* insert new record which pointed to the new page into the parent page */
-	rec.k = p->rec[0].k;
-	rec.v = (uint64_t)new_gpid;
-	insert_rec(d, up_pg, up, ppos, &rec);
-
-	/* release new page */
-	put_page(d, pg);		
+	*sep = s;
+	*newp = p;
+	return pg;
+}
 
-	if (need_to_put) {
-		/* release parent page if it is necessary */
-		put_page(d, up_pg);
+/*
+ * bpt_split_root() -- split the root page if it is still full, or if it is 
+ * split (see bpt_insert()), the tree grows one level higher. d->root_latch 
+ * is held exclusively meanwhile, so nobody is on the way to the root page.
+ */
+static void bpt_split_root(kvdb_t d, gpid_t split)
+{
+	pg_t pg, rpg, npg;
+	struct page_s *p, *r, *np;
+	struct record_s rec;
+	uint64_t sep;
+	gpid_t old;
+
+	pthread_rwlock_wrlock(&d->root_latch);
+	old = d->h->root_gpid;
+	pg = latch_get(d, old, 1, &p);
+	if (page_full(d, pg, p, old==split)) {
+		rec.k = (p->h.flags & PAGE_LEAF) ? p->k[0] : br_key(p, 0);
+		rec.v = (uint64_t)old;
+		rpg = bpt_make_root(d, 0, &rec, &r);
+		npg = bpt_split(d, rpg, r, 0, pg, p, &np, &sep);
+		kvdb_assert(npg!=NULL);
+		latch_put(d, npg);
+		latch_put(d, rpg);
 	}
+	latch_put(d, pg);
+	pthread_rwlock_unlock(&d->root_latch);
 }
 
 /* 
- * bpt_insert -- insert a record into a B+ Tree
+ * bpt_insert -- insert a record into a B+ Tree, crabbing down from the root
+ *
+ * optimistic -- latch the branch pages shared and only the leaf exclusively,
+ *               and give up with RESTART if the leaf is full.
+ *
+ * Otherwise all pages are latched exclusively and every full page met on the 
+ * way down is split, which is always possible because its parent is not full.
+ * The parent is released as soon as the child is known not to be full, so no 
+ * more than two levels are latched at any moment.
+ *
+ * If lsn is not NULL, the record is logged while the leaf is latched, so that
+ * the order of the log is the order in which any single key is changed.
  *
- * ppos - the position of current page record in parent page
- *        if the parent is root, then ppos==-1
- * curr -- the current page's gpid
- * rec -- the record to be inserted
- * 
- * return OK, success
+ * A branch page which is not full may still fail to take the record of a split
+ * child, if the keys no longer fit its encoding (see branch.c). The child is
+ * left as it is then, and *split tells the next pass to split the branch page
+ * on the way down.
  *
- * return PAGE_SPLITED, means the caller should the function again because the page is full 
- * and it split into two pieces
+ * return REC_INSERTED or REC_REPLACED, success
+ *        RESTART, the caller should try again pessimistically
  */
-static int bpt_insert(kvdb_t d, pg_t ppg, struct page_s *parent, int ppos, gpid_t curr, struct record_s *rec)
+static int bpt_insert(kvdb_t d, struct record_s *rec, int optimistic, uint64_t *lsn,
+		gpid_t *split)
 {
-	struct page_s *p;
-	pg_t pg;
-	int pos;
+	struct page_s *p = NULL, *c, *np;
+	pg_t pg, cpg, npg;
+	gpid_t gpid, cgpid;
+	int level, pos;
+	uint64_t sep;
 	int ret;
 
-	//fprintf(stderr, "bpt_insert(): gpid=%lu, ppos=%d, parent=%p, rec=(%lu, %lu)\n", 
-	//		curr, ppos, parent, rec->k, rec->v);
-
-	pg = get_page(d, curr);
-	p = get_page_buf(d, pg);
-	if (p->h.record_num>=RECORD_NUM_PG) {
-		bpt_split(d, ppg, parent, ppos, p);
-		put_page(d, pg);
-		return PAGE_SPLITED;
+	pg = latch_root(d, optimistic ? 1 : INT_MAX, &p, &level);
+	gpid = d->h->root_gpid;
+	if (!optimistic && level>1 && page_full(d, pg, p, gpid==*split)) {
+		latch_put(d, pg);
+		bpt_split_root(d, *split);
+		*split = GPID_NIL;
+		return RESTART;
 	}
 
-	if (p->h.flags & PAGE_LEAF) {
+	for (; level>1; level--) {
 		pos = find_key(p, rec->k);
 		if (pos<0) {
 			pos = 0;
 		}
-		ret = insert_rec(d, pg, p, pos, rec);
-	} else {
-		int tries = 0; 
-
-		do {
-			pos = find_key(p, rec->k);
-			if (pos<0) {
-				pos = 0;
+		cgpid = br_child(p, pos);
+		cpg = latch_get(d, cgpid, !optimistic || level==2, &c);
+		if (!optimistic && page_full(d, cpg, c, cgpid==*split)) {
+			npg = bpt_split(d, pg, p, pos, cpg, c, &np, &sep);
+			if (npg==NULL) {
+				/* split the parent on the way down next time */
+				*split = gpid;
+				latch_put(d, cpg);
+				latch_put(d, pg);
+				return RESTART;
+			}
+			if (cgpid==*split) {
+				*split = GPID_NIL;
+			}
+			if (rec->k >= sep) {
+				latch_put(d, cpg);
+				cgpid = c->h.next;
+				cpg = npg;
+				c = np;
+			} else {
+				latch_put(d, npg);
 			}
-			ret = bpt_insert(d, pg, p, pos, (gpid_t)p->rec[pos].v, rec);
-			tries ++;
-		} while (ret==PAGE_SPLITED);
-		kvdb_assert(tries<=2);
+		}
+		latch_put(d, pg);
+		pg = cpg;
+		p = c;
+		gpid = cgpid;
 	}
-	put_page(d, pg);
 
-	return ret==REC_REPLACED ? REC_REPLACED : REC_INSERTED;
+	pos = find_key(p, rec->k);
+	if (p->h.record_num>=RECORD_NUM_PG && (pos<0 || p->k[pos]!=rec->k)) {
+		/* the leaf is full, a root leaf is split here too */
+		latch_put(d, pg);
+		if (!optimistic) {
+			bpt_split_root(d, GPID_NIL);
+		}
+		return RESTART;
+	}
+	if (pos<0) {
+		pos = 0;
+	}
+	ret = insert_rec(d, pg, p, pos, rec);
+	if (lsn!=NULL) {
+		*lsn = log_append(d, LOG_PUT, rec->k, rec->v);
+	}
+	latch_put(d, pg);
+
+	return ret;
 }
 
-int kvdb_put(kvdb_t d, uint64_t k, uint64_t v)
+static int do_put(kvdb_t d, uint64_t k, uint64_t v, uint64_t *lsn)
 {
-	int tries = 0; 
 	struct record_s rec;
+	struct page_s *p;
+	gpid_t split = GPID_NIL;
 	int ret;
 
 	if (d->h->level==0) {
-		bpt_make_root(d, 1);
+		pthread_rwlock_wrlock(&d->root_latch);
+		if (d->h->level==0) {
+			latch_put(d, bpt_make_root(d, 1, NULL, &p));
+		}
+		pthread_rwlock_unlock(&d->root_latch);
 	}
 	rec.k = k;
 	rec.v = v;
-	do {
-		ret = bpt_insert(d, NULL, NULL, -1, d->h->root_gpid, &rec);
-		tries ++;
-		kvdb_assert(tries<=2);
-	} while (ret==PAGE_SPLITED);
+	ret = bpt_insert(d, &rec, 1, lsn, &split);
+	while (ret==RESTART) {
+		ret = bpt_insert(d, &rec, 0, lsn, &split);
+	}
 
 	if (ret!=REC_REPLACED) {
-		d->h->record_num ++;
+		__atomic_add_fetch(&d->h->record_num, 1, __ATOMIC_RELAXED);
 	}
 
-	return 0;
+	return ret;
 }
 
-void delete_rec(struct page_s *p, int pos)
+/*
+ * bpt_insert_run() -- insert the records rec[idx[0..n-1]], in key order, into
+ * the leaf the first one belongs to, as many of them as belong to it and
+ * fit in it, with one optimistic descent. The upper bound of the leaf is the
+ * nearest key right of the path down. Each record is logged like in
+ * bpt_insert(), *lsn is the last one.
+ *
+ * return the number of records inserted, 0 if the leaf is full or there is
+ * no tree yet, the caller puts the first one the ordinary way then.
+ */
+static int bpt_insert_run(kvdb_t d, struct kvdb_rec_s *rec, int *idx, int n,
+		int *status, uint64_t *lsn)
 {
-	int i;
+	struct page_s *p = NULL, *c;
+	struct record_s r;
+	uint64_t hi = 0;
+	int bounded = 0, level, pos, i, ret, ins = 0;
+	pg_t pg, cpg;
+
+	pg = latch_root(d, 1, &p, &level);
+	if (pg==NULL) {
+		return 0;
+	}
+	for (; level>1; level--) {
+		pos = find_key(p, rec[idx[0]].k);
+		if (pos<0) {
+			pos = 0;
+		}
+		if (pos+1<p->h.record_num && (!bounded || br_key(p, pos+1)<hi)) {
+			hi = br_key(p, pos+1);
+			bounded = 1;
+		}
+		cpg = latch_get(d, br_child(p, pos), level==2, &c);
+		latch_put(d, pg);
+		pg = cpg;
+		p = c;
+	}
+
+	for (i=0; i<n; i++) {
+		r.k = rec[idx[i]].k;
+		r.v = rec[idx[i]].v;
+		if (bounded && r.k>=hi) {
+			break;
+		}
+		pos = find_key(p, r.k);
+		if (p->h.record_num>=RECORD_NUM_PG && (pos<0 || p->k[pos]!=r.k)) {
+			break;
+		}
+		ret = leaf_insert(p, pos<0 ? 0 : pos, &r);
+		*lsn = log_append(d, LOG_PUT, r.k, r.v);
+		if (status!=NULL) {
+			status[idx[i]] = (ret==REC_REPLACED) ? KVDB_REPLACED : KVDB_INSERTED;
+		}
+		ins += (ret==REC_INSERTED);
+	}
+	if (i>0) {
+		mark_page_dirty(d, pg);
+		__atomic_add_fetch(&d->h->record_num, ins, __ATOMIC_RELAXED);
+	}
+	latch_put(d, pg);
+	return i;
+}
 
+void delete_rec(struct page_s *p, int pos)
+{
 	if (p->h.record_num == 1) {
 		p->h.record_num = 0;
 		return;
 	}
 
-	for (i=pos; i<p->h.record_num-1; i++) {
-		p->rec[i].k = p->rec[i+1].k;
-		p->rec[i].v = p->rec[i+1].v;
-	}
+	move_recs(p, pos, p, pos+1, p->h.record_num-pos-1);
 	p->h.record_num --;
 }
 
-
-/* 
- * return OK            -- success, nothing following step is needed to do .
- *        PAGE_DELETED  -- success, the page is empty and has been deleted, so the entry which 
- *                         pointed to that page is needed to delete.
- *        REC_NOT_FOUND -- there is not the record to be deleted
- *  
+/*
+ * bpt_shrink_root() -- make the only child of the root the new root, the 
+ * tree becomes one level lower. d->root_latch is held exclusively meanwhile
+ * like in bpt_split_root().
  */
-int bpt_del(kvdb_t d, gpid_t gpid, uint64_t k)
+static void bpt_shrink_root(kvdb_t d)
 {
-	pg_t pg;
 	struct page_s *p;
-	int pos, ret = OK;
-
-	pg = get_page(d, gpid);
-	p = get_page_buf(d, pg);
-	pos = find_key(p, k);
+	gpid_t old;
+	pg_t pg;
 
-	if ((p->h.flags & PAGE_LEAF) == 0) {
-		ret = bpt_del(d, (gpid_t)p->rec[pos].v, k);
-		if (ret == PAGE_DELETED) {
-			delete_rec(p, pos);
-			if (p->h.record_num == 0) {
-				goto delete_page;
-			}
-		}
-	} else {
-		if (p->rec[pos].k != k) {
-			ret = REC_NOT_FOUND;
+	pthread_rwlock_wrlock(&d->root_latch);
+	old = d->h->root_gpid;
+	if (d->h->level>1) {
+		pg = latch_get(d, old, 1, &p);
+		if (p->h.record_num==1) {
+			__atomic_store_n(&d->h->root_gpid, br_child(p, 0), __ATOMIC_RELEASE);
+			d->h->level --;
+			latch_put(d, pg);
+			free_page(d, old);
 		} else {
-			delete_rec(p, pos);
-			if (p->h.record_num == 0) {
-				goto delete_page;
-			} else {
-				ret = OK;
-			}
+			latch_put(d, pg);
 		}
 	}
-
-	put_page(d, pg);
-	return ret;		/* OK or NOT_FOUND */
-
-delete_page:
-	put_page(d, pg);
-	free_page(d, gpid);
-	return PAGE_DELETED;
+	pthread_rwlock_unlock(&d->root_latch);
 }
 
-int kvdb_del(kvdb_t d, uint64_t k)
+/* the i-th key of the records of two leaves one after the other */
+static uint64_t leaf_key2(struct page_s *l, struct page_s *r, int i)
 {
-	int ret;
-
-	kvdb_dump_page(d, d->h->root_gpid);
+	return i < l->h.record_num ? l->k[i] : r->k[i - l->h.record_num];
+}
 
-	ret = bpt_del(d, d->h->root_gpid, k);
-	if (ret==PAGE_DELETED) {
-		d->h->level = 0;
-		d->h->root_gpid = GPID_NIL;
+/*
+ * bpt_rebalance() -- the pos-th child *cp of the parent is thin, merge it 
+ * with a sibling if their records fit one page well, or else move records
+ * from the sibling so that both hold half of them. The left one of the two
+ * is latched first like cursors do, so *cp may be let go and latched again,
+ * nobody gets into it meanwhile since the parent is latched exclusively. If
+ * the new key of the right one does not fit the parent (see branch.c), 
+ * nothing is changed.
+ *
+ * Return the page k belongs to, latched exclusively, in *cp, the other one
+ * is released.
+ */
+static pg_t bpt_rebalance(kvdb_t d, pg_t ppg, struct page_s *parent, int pos,
+		pg_t cpg, struct page_s **cp, uint64_t k)
+{
+	struct page_s *l, *r;
+	pg_t lpg, rpg;
+	gpid_t rgpid;
+	uint64_t sep, nsep;
+	int rpos, n, m, ret;
+
+	if (pos>0) {
+		latch_put(d, cpg);
+		lpg = latch_get(d, br_child(parent, pos-1), 1, &l);
+		rpos = pos;
+	} else {
+		lpg = cpg;
+		l = *cp;
+		rpos = 1;
 	}
-	if (ret==PAGE_DELETED || ret==OK) {
-		d->h->record_num --;
+	rgpid = br_child(parent, rpos);
+	rpg = latch_get(d, rgpid, 1, &r);
+	sep = br_key(parent, rpos);
+	n = l->h.record_num + r->h.record_num;
+
+	if (n<=MERGE_MAX) {
+		if (l->h.flags & PAGE_LEAF) {
+			move_recs(l, l->h.record_num, r, 0, r->h.record_num);
+			l->h.record_num = n;
+		} else {
+			ret = br_merge(l, r, sep);
+			kvdb_assert(ret==0);
+		}
+		l->h.next = r->h.next;
+		br_delete(parent, rpos);
+		mark_page_dirty(d, lpg);
+		mark_page_dirty(d, ppg);
+		latch_put(d, rpg);
+		free_page(d, rgpid);
+		stat_add(d, STAT_MERGE, 1);
+		*cp = l;
+		return lpg;
 	}
-	return ret==REC_NOT_FOUND ? -1: 0;
-}
 
-int bpt_search(kvdb_t d, gpid_t gpid, uint64_t k, struct record_s *rec, struct cursor_s *cs)
-{
-	pg_t pg;
+	m = n / 2;
+	if (l->h.flags & PAGE_LEAF) {
+		nsep = br_sep(leaf_key2(l, r, m-1), leaf_key2(l, r, m));
+	} else if (m < l->h.record_num) {
+		nsep = br_key(l, m);
+	} else {
+		nsep = (m==l->h.record_num) ? sep : br_key(r, m - l->h.record_num);
+	}
+	if (nsep <= br_key(parent, rpos-1) || br_set_key(parent, rpos, nsep)!=0) {
+		goto out;
+	}
+	if ((l->h.flags & PAGE_LEAF)==0) {
+		if (br_balance(l, r, sep, m)!=0) {
+			ret = br_set_key(parent, rpos, sep);
+			kvdb_assert(ret==0);
+			goto out;
+		}
+	} else if (m < l->h.record_num) {
+		move_recs(r, l->h.record_num - m, r, 0, r->h.record_num);
+		move_recs(r, 0, l, m, l->h.record_num - m);
+		r->h.record_num = n - m;
+		l->h.record_num = m;
+	} else {
+		move_recs(l, l->h.record_num, r, 0, m - l->h.record_num);
+		move_recs(r, 0, r, m - l->h.record_num, n - m);
+		r->h.record_num = n - m;
+		l->h.record_num = m;
+	}
+	mark_page_dirty(d, lpg);
+	mark_page_dirty(d, rpg);
+	mark_page_dirty(d, ppg);
+
+out:
+	if (k >= br_key(parent, rpos)) {
+		latch_put(d, lpg);
+		*cp = r;
+		return rpg;
+	}
+	latch_put(d, rpg);
+	*cp = l;
+	return lpg;
+}
+
+/* 
+ * bpt_del -- delete a record, crabbing down from the root
+ *
+ * optimistic -- latch the branch pages shared and only the leaf exclusively,
+ *               and give up with RESTART if the leaf would become thin.
+ *
+ * Otherwise all pages are latched exclusively, and every thin page met on
+ * the way down is rebalanced with a sibling, which is always possible since
+ * its parent has been rebalanced before, unless it is the root. A page is 
+ * thin if it holds no more than MERGE_NUM records, a branch page whose only
+ * child is thin is left alone, so it never loses its last child. The tree
+ * becomes lower when the root has only one child left.
+ *
+ * return OK            -- success
+ *        REC_NOT_FOUND -- there is not the record to be deleted
+ *        RESTART       -- the caller should try again pessimistically
+ */
+static int bpt_del(kvdb_t d, uint64_t k, int optimistic, uint64_t *lsn)
+{
+	pg_t pg, cpg;
+	struct page_s *p, *c;
+	int level, top, pos, shrink = 0, ret = OK;
+
+	pg = latch_root(d, optimistic ? 1 : INT_MAX, &p, &level);
+	if (pg==NULL) {
+		return REC_NOT_FOUND;
+	}
+	if (!optimistic && level>1 && p->h.record_num==1) {
+		latch_put(d, pg);
+		bpt_shrink_root(d);
+		return RESTART;
+	}
+	for (top=level; level>1; level--) {
+		pos = find_key(p, k);
+		if (pos<0) {
+			pos = 0;
+		}
+		cpg = latch_get(d, br_child(p, pos), !optimistic || level==2, &c);
+		if (c->h.record_num<=MERGE_NUM && p->h.record_num>1) {
+			if (optimistic && level==2) {
+				latch_put(d, cpg);
+				latch_put(d, pg);
+				return RESTART;
+			}
+			if (!optimistic) {
+				cpg = bpt_rebalance(d, pg, p, pos, cpg, &c, k);
+				shrink |= (level==top && p->h.record_num==1);
+			}
+		}
+		latch_put(d, pg);
+		pg = cpg;
+		p = c;
+	}
+
+	pos = find_key(p, k);
+	if (pos<0 || p->k[pos]!=k) {
+		ret = REC_NOT_FOUND;
+	} else {
+		delete_rec(p, pos);
+		mark_page_dirty(d, pg);
+		if (lsn!=NULL) {
+			*lsn = log_append(d, LOG_DEL, k, 0);
+		}
+	}
+	latch_put(d, pg);
+	if (shrink) {
+		bpt_shrink_root(d);
+	}
+	return ret;
+}
+
+static int do_del(kvdb_t d, uint64_t k, uint64_t *lsn)
+{
+	int ret;
+
+	ret = bpt_del(d, k, 1, lsn);
+	while (ret==RESTART) {
+		ret = bpt_del(d, k, 0, lsn);
+	}
+	if (ret==OK) {
+		__atomic_sub_fetch(&d->h->record_num, 1, __ATOMIC_RELAXED);
+	}
+	return ret;
+}
+
+/*
+ * free_tree() -- free a subtree no one could reach any more, a page at a 
+ * time from the left, the way cursors go. Every page is latched exclusively
+ * first, so the readers still in the subtree are out of a page before it is
+ * freed. Return the number of records the leaves held.
+ */
+uint64_t free_tree(kvdb_t d, gpid_t gpid)
+{
+	gpid_t child[BRANCH_NUM_PG];
 	struct page_s *p;
+	uint64_t num = 0;
+	int i, n = 0;
+	pg_t pg;
+
+	pg = latch_get(d, gpid, 1, &p);
+	if (p->h.flags & PAGE_LEAF) {
+		num = p->h.record_num;
+	} else {
+		n = p->h.record_num;
+		for (i=0; i<n; i++) {
+			child[i] = br_child(p, i);
+		}
+	}
+	latch_put(d, pg);
+	free_page(d, gpid);
+	for (i=0; i<n; i++) {
+		num += free_tree(d, child[i]);
+	}
+	return num;
+}
+
+/* the position of the first record of a leaf not less than k */
+static int leaf_lower_bound(struct page_s *p, uint64_t k)
+{
 	int pos;
-	gpid_t next;
+
+	pos = find_key(p, k);
+	if (pos>=0 && p->k[pos]==k) {
+		return pos;
+	}
+	return pos + 1;
+}
+
+/* delete the records from the from-th to the one before the to-th */
+static int leaf_cut(kvdb_t d, pg_t pg, struct page_s *p, int from, int to)
+{
+	if (to<=from) {
+		return 0;
+	}
+	move_recs(p, from, p, to, p->h.record_num - to);
+	p->h.record_num -= to - from;
+	mark_page_dirty(d, pg);
+	return to - from;
+}
+
+/* take the children from the from-th to the one before the to-th off a branch */
+static int branch_cut(kvdb_t d, pg_t pg, struct page_s *p, int from, int to, gpid_t *out)
+{
+	int i;
+
+	for (i=from; i<to; i++) {
+		out[i-from] = br_child(p, i);
+	}
+	for (i=to-1; i>=from; i--) {
+		br_delete(p, i);
+	}
+	if (to>from) {
+		mark_page_dirty(d, pg);
+	}
+	return to>from ? to - from : 0;
+}
+
+/*
+ * do_del_range() -- delete the records in [start, end), the caller holds 
+ * d->lock exclusively so that nothing else changes the tree meanwhile.
+ *
+ * Two paths are followed down with exclusive latches, the left one to start
+ * and the right one to end, they are the same pages until they fork. Every
+ * page between them holds records of the range only, so its subtree is taken
+ * off the pages of the paths and freed as a whole, and only the two leaves at
+ * the ends have records deleted one by one. On each level the left page is 
+ * chained to the right one before anything is freed, then the subtrees are
+ * freed in the order of their keys, so that a cursor in one of them only 
+ * meets pages not yet freed as it goes on. Pages of the paths stay even if
+ * they become empty, a branch page never loses its last child that way, and
+ * the thin ones are rebalanced afterwards by a pessimistic bpt_del() of a key
+ * of the range on either side, which finds nothing to delete any more.
+ *
+ * Return the number of records deleted.
+ */
+static uint64_t do_del_range(kvdb_t d, uint64_t start, uint64_t end)
+{
+	pg_t lpg, rpg, lcpg, rcpg;
+	struct page_s *l, *r, *lc, *rc;
+	gpid_t lgpid, rgpid, lcgpid, rcgpid;
+	gpid_t *freed;
+	int *nl, *nr;
+	int level, depth, i, li, ri;
+	uint64_t num = 0;
+
+	if (start>=end) {
+		return 0;
+	}
+	lpg = latch_root(d, INT_MAX, &l, &level);
+	if (lpg==NULL) {
+		return 0;
+	}
+	lgpid = d->h->root_gpid;
+	rpg = lpg;
+	r = l;
+	rgpid = lgpid;
+
+	/* subtrees taken off the left and the right page of each level */
+	freed = malloc(level * 2 * BRANCH_NUM_PG * sizeof(gpid_t));
+	nl = calloc(level * 2, sizeof(int));
+	kvdb_assert(freed!=NULL && nl!=NULL);
+	nr = nl + level;
+
+	for (depth=0; depth<level-1; depth++) {
+		li = find_key(l, start);
+		li = li<0 ? 0 : li;
+		if (lpg==rpg) {
+			ri = find_key(l, end);
+			ri = ri<0 ? 0 : ri;
+			nl[depth] = branch_cut(d, lpg, l, li+1, ri, 
+					&freed[(2*depth)*BRANCH_NUM_PG]);
+			lcgpid = br_child(l, li);
+			rcgpid = br_child(l, ri>li ? li+1 : li);
+		} else {
+			ri = find_key(r, end);
+			ri = ri<0 ? 0 : ri;
+			nl[depth] = branch_cut(d, lpg, l, li+1, l->h.record_num, 
+					&freed[(2*depth)*BRANCH_NUM_PG]);
+			nr[depth] = branch_cut(d, rpg, r, 0, ri, 
+					&freed[(2*depth+1)*BRANCH_NUM_PG]);
+			l->h.next = rgpid;
+			mark_page_dirty(d, lpg);
+			lcgpid = br_child(l, li);
+			rcgpid = br_child(r, 0);
+		}
+		lcpg = latch_get(d, lcgpid, 1, &lc);
+		rcpg = lcpg;
+		rc = lc;
+		if (rcgpid!=lcgpid) {
+			rcpg = latch_get(d, rcgpid, 1, &rc);
+		}
+		if (rpg!=lpg) {
+			latch_put(d, rpg);
+		}
+		latch_put(d, lpg);
+		lpg = lcpg;
+		l = lc;
+		lgpid = lcgpid;
+		rpg = rcpg;
+		r = rc;
+		rgpid = rcgpid;
+	}
+
+	if (lpg==rpg) {
+		num += leaf_cut(d, lpg, l, leaf_lower_bound(l, start), 
+				leaf_lower_bound(l, end));
+	} else {
+		num += leaf_cut(d, lpg, l, leaf_lower_bound(l, start), l->h.record_num);
+		num += leaf_cut(d, rpg, r, 0, leaf_lower_bound(r, end));
+		l->h.next = rgpid;
+		mark_page_dirty(d, lpg);
+		latch_put(d, rpg);
+	}
+	latch_put(d, lpg);
+
+	for (depth=level-2; depth>=0; depth--) {
+		for (i=0; i<nl[depth]; i++) {
+			num += free_tree(d, freed[(2*depth)*BRANCH_NUM_PG+i]);
+		}
+	}
+	for (depth=0; depth<level-1; depth++) {
+		for (i=0; i<nr[depth]; i++) {
+			num += free_tree(d, freed[(2*depth+1)*BRANCH_NUM_PG+i]);
+		}
+	}
+	free(freed);
+	free(nl);
+
+	while (bpt_del(d, start, 0, NULL)==RESTART)
+		;
+	while (bpt_del(d, end - 1, 0, NULL)==RESTART)
+		;
+	__atomic_sub_fetch(&d->h->record_num, num, __ATOMIC_RELAXED);
+	return num;
+}
+
+/* 
+ * kvdb_checkpoint() -- make the database file durable and empty the log,
+ * d->lock must be held exclusively so that nothing could be logged meanwhile.
+ * The header is changed in place through its mapping, so its image is logged
+ * right away rather than when it is first changed.
+ */
+static void kvdb_checkpoint(kvdb_t d)
+{
 	int ret;
 
+	sync_all_page(d);
+	sync_allocator(d);
+	ret = msync(d->h, FILE_HEADER_LEN, MS_SYNC);
+	kvdb_assert(ret==0);
+	ret = fsync(d->fd);
+	kvdb_assert(ret==0);
+	stat_add(d, STAT_MSYNC, 1);
+	stat_add(d, STAT_MSYNC_BYTES, FILE_HEADER_LEN);
+	stat_add(d, STAT_FSYNC, 1);
+	reset_log(d);
+	log_page(d, 0, d->h);
+}
 
-	pg = get_page(d, gpid);
-	p = get_page_buf(d, pg);
-	pos = find_key(p, k);
-	/*
-	fprintf(stderr, "bpt_search(): gpid=%lu(%s), k=%lu, pos=%d, \n", 
-		gpid, (p->h.flags&PAGE_LEAF ? "leaf" : "branch"), k, pos);
-	if ((p->h.flags & PAGE_LEAF) == 0) {
-		_kvdb_dump_page(gpid, p);
-	}*/
-	if ((p->h.flags & PAGE_LEAF) != 0) {
-		if (pos<0) {
-			ret = REC_NOT_FOUND;
-			goto end;
+static void kvdb_checkpoint_if_needed(kvdb_t d)
+{
+	if (!log_need_checkpoint(d))
+		return;
+	pthread_rwlock_wrlock(&d->lock);
+	if (log_need_checkpoint(d)) {
+		kvdb_checkpoint(d);
+	}
+	pthread_rwlock_unlock(&d->lock);
+}
+
+static void redo_rec(kvdb_t d, struct log_rec_s *r)
+{
+	if (r->op==LOG_PUT) {
+		do_put(d, r->k, r->v, NULL);
+	} else if (r->op==LOG_DEL) {
+		do_del(d, r->k, NULL);
+	} else if (r->op==LOG_DEL_RANGE) {
+		do_del_range(d, r->k, r->v);
+	}
+}
+
+/*
+ * kvdb_put() and kvdb_del() return after the change is in the log on disk.
+ * The tree is changed and the record logged with d->lock held shared, which
+ * only keeps a checkpoint out, while the wait for the log happens outside of
+ * it, so that concurrent callers are committed together by one fdatasync().
+ */
+int kvdb_put(kvdb_t d, uint64_t k, uint64_t v)
+{
+	uint64_t lsn, t = stat_begin(d);
+
+	pthread_rwlock_rdlock(&d->lock);
+	do_put(d, k, v, &lsn);
+	pthread_rwlock_unlock(&d->lock);
+
+	kvdb_checkpoint_if_needed(d);
+	log_commit(d, lsn);
+	stat_end(d, KVDB_OP_PUT, t);
+	return 0;
+}
+
+int kvdb_del(kvdb_t d, uint64_t k)
+{
+	uint64_t lsn, t = stat_begin(d);
+	int ret;
+
+	pthread_rwlock_rdlock(&d->lock);
+	ret = do_del(d, k, &lsn);
+	pthread_rwlock_unlock(&d->lock);
+	if (ret==REC_NOT_FOUND) {
+		stat_end(d, KVDB_OP_DEL, t);
+		return -1;
+	}
+
+	kvdb_checkpoint_if_needed(d);
+	log_commit(d, lsn);
+	stat_end(d, KVDB_OP_DEL, t);
+	return 0;
+}
+
+/*
+ * kvdb_del_range() -- delete the records from start_key up to but not 
+ * including end_key, return the number of them. The range is logged as one
+ * record, and d->lock is held exclusively since whole subtrees are freed.
+ */
+uint64_t kvdb_del_range(kvdb_t d, uint64_t start_key, uint64_t end_key)
+{
+	uint64_t num, lsn = 0;
+
+	pthread_rwlock_wrlock(&d->lock);
+	num = do_del_range(d, start_key, end_key);
+	if (num>0) {
+		lsn = log_append(d, LOG_DEL_RANGE, start_key, end_key);
+	}
+	pthread_rwlock_unlock(&d->lock);
+	if (num==0) {
+		return 0;
+	}
+
+	kvdb_checkpoint_if_needed(d);
+	log_commit(d, lsn);
+	return num;
+}
+
+struct batch_key_s {
+	uint64_t k;
+	int i;
+};
+
+static int cmp_batch_key(const void *a, const void *b)
+{
+	const struct batch_key_s *x = a, *y = b;
+
+	if (x->k!=y->k)
+		return x->k < y->k ? -1 : 1;
+	return x->i - y->i;
+}
+
+/*
+ * kvdb_put_batch() -- put n records, status[i] tells whether rec[i] was
+ * inserted or replaced an older value, if status is not NULL. The records
+ * are sorted by key, records of the same key in the order they are given,
+ * and all of them which go to the same leaf are put with one descent, see
+ * bpt_insert_run(). It returns after all of them are in the log on disk.
+ */
+int kvdb_put_batch(kvdb_t d, struct kvdb_rec_s *rec, int n, int *status)
+{
+	struct batch_key_s *bk;
+	uint64_t lsn = 0, t;
+	int *idx, i, m, ret;
+
+	if (n<=0) {
+		return 0;
+	}
+	t = stat_begin(d);
+	bk = (struct batch_key_s *)malloc(n * sizeof(*bk));
+	idx = (int *)malloc(n * sizeof(int));
+	kvdb_assert(bk!=NULL && idx!=NULL);
+	for (i=0; i<n; i++) {
+		bk[i].k = rec[i].k;
+		bk[i].i = i;
+	}
+	qsort(bk, n, sizeof(*bk), cmp_batch_key);
+	for (i=0; i<n; i++) {
+		idx[i] = bk[i].i;
+	}
+	free(bk);
+
+	pthread_rwlock_rdlock(&d->lock);
+	for (i=0; i<n; i+=m) {
+		m = bpt_insert_run(d, rec, &idx[i], n-i, status, &lsn);
+		if (m==0) {
+			ret = do_put(d, rec[idx[i]].k, rec[idx[i]].v, &lsn);
+			if (status!=NULL) {
+				status[idx[i]] = (ret==REC_REPLACED) ? KVDB_REPLACED : KVDB_INSERTED;
+			}
+			m = 1;
+		}
+	}
+	pthread_rwlock_unlock(&d->lock);
+	free(idx);
+
+	kvdb_checkpoint_if_needed(d);
+	log_commit(d, lsn);
+	stat_end(d, KVDB_OP_BATCH, t);
+	return 0;
+}
+
+static void bulk_put(kvdb_t d, uint64_t k, uint64_t v)
+{
+	do_put(d, k, v, NULL);
+}
+
+/*
+ * kvdb_bulk_load() -- load the records next() returns, until it returns -1,
+ * into an empty database, see bulk.c. Leaves are filled up to fill percent,
+ * or a default if it is 0. The records are durable when it returns.
+ *
+ * return 0 if success, -1 if the database is not empty
+ */
+int kvdb_bulk_load(kvdb_t d, int (*next)(void *arg, uint64_t *k, uint64_t *v),
+		void *arg, int fill)
+{
+	pthread_rwlock_wrlock(&d->lock);
+	if (d->h->record_num!=0) {
+		pthread_rwlock_unlock(&d->lock);
+		return -1;
+	}
+	bulk_load(d, next, arg, fill, bulk_put);
+	kvdb_checkpoint(d);
+	pthread_rwlock_unlock(&d->lock);
+	return 0;
+}
+
+/*
+ * bpt_move_page() -- copy page x of the tree to the free page to, and point
+ * its parent, or the root, and the page before it on its level at the copy.
+ * The caller holds d->lock exclusively, so only readers are in the tree: x
+ * is found without latches by a key of its subtree, and pages are latched 
+ * exclusively only to be changed. If somebody has x or the page before it
+ * latched, x is left where it is rather than waited for.
+ *
+ * return 0 if x has been moved, -1 if not
+ */
+static int bpt_move_page(kvdb_t d, gpid_t x, gpid_t to)
+{
+	int level = d->h->level, depth, found, i, ret = -1;
+	gpid_t path[level], gpid, lgpid = GPID_NIL;
+	struct page_s *p, *l = NULL, *xp, *t;
+	pg_t pg, ppg, lpg = NULL, xpg, tpg;
+	int pos[level];
+	uint64_t k;
+
+	if (x==d->h->root_gpid) {
+		pthread_rwlock_wrlock(&d->root_latch);
+		/* a cursor could only be on the root if it is a leaf */
+		xpg = get_page(d, x);
+		if ((get_page_buf(d, xpg)->h.flags & PAGE_LEAF)==0) {
+			latch_page(d, xpg, 1);
+		} else if (latch_page_try(d, xpg, 1)<0) {
+			put_page(d, xpg);
+			xpg = NULL;
 		}
-		if (rec!=NULL && p->rec[pos].k==k) {
-			rec->k = p->rec[pos].k;
-			rec->v = p->rec[pos].v;
+		if (xpg!=NULL) {
+			tpg = latch_get(d, to, 1, &t);
+			memcpy(t, get_page_buf(d, xpg), PAGE_SIZE);
+			mark_page_dirty(d, tpg);
+			latch_put(d, tpg);
+			__atomic_store_n(&d->h->root_gpid, to, __ATOMIC_RELEASE);
+			latch_put(d, xpg);
+			ret = 0;
 		}
-		ret = (p->rec[pos].k==k ? FOUND_EXACT : FOUND_GREATER);
-		goto end;
+		pthread_rwlock_unlock(&d->root_latch);
+		return ret;
 	}
 
-	if (pos<0) {
-		pos = 0;
+	/* 
+	 * the first key of the first leaf of x, branch pages are never empty. x
+	 * may not be in the tree though, what it holds is not trusted too far.
+	 */
+	for (gpid=x, depth=0; ; depth++) {
+		pg = get_page(d, gpid);
+		p = get_page_buf(d, pg);
+		if (p->h.flags & PAGE_LEAF) {
+			break;
+		}
+		gpid = br_child(p, 0);
+		put_page(d, pg);
+		if (depth==level || get_page_pos(gpid)>=d->h->used_size) {
+			return -1;
+		}
 	}
-	next = (gpid_t)p->rec[pos].v;
+	found = p->h.record_num>0;
+	k = p->k[0];
 	put_page(d, pg);
-	return bpt_search(d, next, k, rec, cs);
+	if (!found) {
+		return -1;
+	}
+
+	gpid = d->h->root_gpid;
+	for (depth=0; depth<level-1; depth++) {
+		pg = get_page(d, gpid);
+		p = get_page_buf(d, pg);
+		i = find_key(p, k);
+		pos[depth] = i<0 ? 0 : i;
+		path[depth] = gpid;
+		gpid = br_child(p, pos[depth]);
+		put_page(d, pg);
+		if (gpid==x) {
+			break;
+		}
+	}
+	if (gpid!=x) {
+		return -1;
+	}
+
+	/* the page before x is the last one under the child before it */
+	for (i=depth; i>=0 && pos[i]==0; i--)
+		;
+	if (i>=0) {
+		pg = get_page(d, path[i]);
+		lgpid = br_child(get_page_buf(d, pg), pos[i] - 1);
+		put_page(d, pg);
+		for (i++; i<=depth; i++) {
+			pg = get_page(d, lgpid);
+			p = get_page_buf(d, pg);
+			lgpid = br_child(p, p->h.record_num - 1);
+			put_page(d, pg);
+		}
+	}
+
+	ppg = latch_get(d, path[depth], 1, &p);
+	if (lgpid!=GPID_NIL) {
+		lpg = get_page(d, lgpid);
+		if (latch_page_try(d, lpg, 1)<0) {
+			put_page(d, lpg);
+			latch_put(d, ppg);
+			return -1;
+		}
+		l = get_page_buf(d, lpg);
+		kvdb_assert(l->h.next==x);
+	}
+	xpg = get_page(d, x);
+	if (latch_page_try(d, xpg, 1)==0) {
+		xp = get_page_buf(d, xpg);
+		tpg = latch_get(d, to, 1, &t);
+		memcpy(t, xp, PAGE_SIZE);
+		mark_page_dirty(d, tpg);
+		latch_put(d, tpg);
+		br_set_child(p, pos[depth], to);
+		mark_page_dirty(d, ppg);
+		if (l!=NULL) {
+			l->h.next = to;
+			mark_page_dirty(d, lpg);
+		}
+		unlatch_page(d, xpg);
+		ret = 0;
+	}
+	put_page(d, xpg);
+	if (lpg!=NULL) {
+		latch_put(d, lpg);
+	}
+	latch_put(d, ppg);
+	return ret;
+}
+
+/*
+ * kvdb_compact() -- shrink the file: pages are moved from its end into the
+ * first free pages, COMPACT_BATCH at a time with d->lock held exclusively
+ * and COMPACT_PAUSE microseconds for writers in between, so that it could 
+ * run while the database is busy. The file is cut after the last page in
+ * use once a checkpoint has made the moves durable, and the runs of free 
+ * pages left before it are punched out.
+ *
+ * Return the number of pages moved.
+ */
+uint64_t kvdb_compact(kvdb_t d)
+{
+	gpid_t x = GPID_NIL, to, end;
+	uint64_t num = 0;
+	int n;
+
+	do {
+		pthread_rwlock_wrlock(&d->lock);
+		/* pages set aside for splits are in use but not in the tree */
+		release_extents(d);
+		for (n=0; n<COMPACT_BATCH; n++) {
+			x = last_used_page(d, x);
+			if (x==GPID_NIL) {
+				break;
+			}
+			to = alloc_page_below(d, x);
+			if (to==GPID_NIL) {
+				x = GPID_NIL;
+				break;
+			}
+			if (bpt_move_page(d, x, to)==0) {
+				free_page(d, x);
+				num ++;
+			} else {
+				free_page(d, to);
+			}
+		}
+		pthread_rwlock_unlock(&d->lock);
+		if (x!=GPID_NIL) {
+			usleep(COMPACT_PAUSE);
+		}
+	} while (x!=GPID_NIL);
+
+	pthread_rwlock_wrlock(&d->lock);
+	kvdb_checkpoint(d);
+	end = discard_pages(d, file_end_page(d));
+	shrink_cache_area(d, get_page_pos(end));
+	cut_file(d, end);
+	punch_free_pages(d);
+	kvdb_checkpoint(d);
+	pthread_rwlock_unlock(&d->lock);
+	return num;
+}
+
+/*
+ * bpt_search_latched() -- look for k crabbing down with shared latches. If 
+ * cs is not NULL, the leaf stays pinned and latched for the cursor.
+ */
+static int bpt_search_latched(kvdb_t d, uint64_t k, struct record_s *rec, 
+		struct cursor_s *cs)
+{
+	pg_t pg, cpg;
+	struct page_s *p, *c;
+	int level, pos;
+	gpid_t gpid;
+	int ret;
+
+	pg = latch_root(d, 0, &p, &level);
+	if (pg==NULL) {
+		if (cs!=NULL) {
+			cs->gpid = GPID_NIL;
+		}
+		return REC_NOT_FOUND;
+	}
+	gpid = d->h->root_gpid;
+	while ((p->h.flags & PAGE_LEAF) == 0) {
+		pos = find_key(p, k);
+		if (pos<0) {
+			pos = 0;
+		}
+		gpid = br_child(p, pos);
+		cpg = latch_get(d, gpid, 0, &c);
+		latch_put(d, pg);
+		pg = cpg;
+		p = c;
+	}
+
+	pos = find_key(p, k);
+	if (pos<0) {
+		ret = REC_NOT_FOUND;
+	} else {
+		if (rec!=NULL && p->k[pos]==k) {
+			rec->k = p->k[pos];
+			rec->v = p->v[pos];
+		}
+		ret = (p->k[pos]==k ? FOUND_EXACT : FOUND_GREATER);
+	}
 
-end:
 	if (cs!=NULL) {
 		cs->gpid = gpid;
 		cs->pg = pg;
 		cs->p = p;
 		cs->pos = pos;
 	} else {
-		put_page(d, pg);
+		latch_put(d, pg);
 	}
 	return ret;
 }
 
+/*
+ * olc_step() -- find k in a page read optimistically. find_key() stays within 
+ * the page whatever it reads, the flags are read once afterwards so that the
+ * record is read as they say.
+ *
+ * return 0 if p is a leaf, with the position of k in *pos
+ *        1 if p is a branch page, with the child to go on with in *child
+ *       -1 if what has been read could not be right
+ */
+static int olc_step(struct page_s *p, uint64_t k, int *pos, gpid_t *child)
+{
+	uint32_t flags;
+	int i;
+
+	i = find_key(p, k);
+	flags = __atomic_load_n(&p->h.flags, __ATOMIC_RELAXED);
+	if (flags & PAGE_LEAF) {
+		*pos = i;
+		return (i<(int)RECORD_NUM_PG) ? 0 : -1;
+	}
+	if (i<0) {
+		i = 0;
+	}
+	if (flags & PAGE_COMPACT) {
+		*child = ((struct branch_s *)p)->c[i];
+	} else if (i<(int)RECORD_NUM_PG) {
+		*child = (gpid_t)p->v[i];
+	} else {
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * bpt_search_olc() -- look for k with optimistic lock coupling, nothing 
+ * shared is written on the way down: every page is validated against its
+ * version after what is needed from it has been read, and the child's 
+ * version is taken before the parent is validated, so that a change of 
+ * either one is noticed. For a cursor, the leaf is pinned and latched 
+ * shared at the end, and validated once more with the latch held.
+ *
+ * return RESTART if the search has to be done again, or like bpt_search()
+ */
+static int bpt_search_olc(kvdb_t d, uint64_t k, struct record_s *rec, 
+		struct cursor_s *cs)
+{
+	struct page_s *p;
+	gpid_t gpid, child;
+	uint64_t v, cv, rk, rv;
+	int pos, ret;
+	pg_t pg;
+
+	gpid = __atomic_load_n(&d->h->root_gpid, __ATOMIC_ACQUIRE);
+	if (gpid==GPID_NIL) {
+		/* a tree never becomes empty once it has a root */
+		if (cs!=NULL) {
+			cs->gpid = GPID_NIL;
+		}
+		return REC_NOT_FOUND;
+	}
+	p = peek_page(d, gpid);
+	if (p==NULL) {
+		return RESTART;
+	}
+	v = page_version(d, gpid);
+	if (v==VER_LOCKED) {
+		return RESTART;
+	}
+	/* the root might have been split before its version was taken */
+	if (gpid!=__atomic_load_n(&d->h->root_gpid, __ATOMIC_ACQUIRE)) {
+		return RESTART;
+	}
+
+	for (;;) {
+		ret = olc_step(p, k, &pos, &child);
+		if (ret<0) {
+			return RESTART;
+		}
+		if (ret==0) {
+			break;
+		}
+		p = peek_page(d, child);
+		if (p==NULL) {
+			return RESTART;
+		}
+		cv = page_version(d, child);
+		if (cv==VER_LOCKED || !page_validate(d, gpid, v)) {
+			return RESTART;
+		}
+		gpid = child;
+		v = cv;
+	}
+
+	if (cs!=NULL) {
+		pg = latch_get(d, gpid, 0, &p);
+		if (!page_validate(d, gpid, v)) {
+			latch_put(d, pg);
+			return RESTART;
+		}
+		pos = find_key(p, k);
+		cs->gpid = gpid;
+		cs->pg = pg;
+		cs->p = p;
+		cs->pos = pos;
+		if (pos<0) {
+			return REC_NOT_FOUND;
+		}
+		return (p->k[pos]==k ? FOUND_EXACT : FOUND_GREATER);
+	}
+
+	if (pos<0) {
+		return (page_validate(d, gpid, v) ? REC_NOT_FOUND : RESTART);
+	}
+	rk = p->k[pos];
+	rv = p->v[pos];
+	if (!page_validate(d, gpid, v)) {
+		return RESTART;
+	}
+	if (rec!=NULL && rk==k) {
+		rec->k = rk;
+		rec->v = rv;
+	}
+	return (rk==k ? FOUND_EXACT : FOUND_GREATER);
+}
+
+/*
+ * bpt_search() -- look for k, optimistically first if the pages could be read
+ * that way. If cs is not NULL, the leaf stays pinned and latched for the cursor.
+ */
+int bpt_search(kvdb_t d, uint64_t k, struct record_s *rec, struct cursor_s *cs)
+{
+	int i, ret;
+
+	for (i=0; i<OLC_RETRY; i++) {
+		ret = bpt_search_olc(d, k, rec, cs);
+		if (ret!=RESTART) {
+			return ret;
+		}
+	}
+	return bpt_search_latched(d, k, rec, cs);
+}
+
 /* 
  * return 0 -- we have found it
  *       -1 -- have not fount it
@@ -611,9 +1880,10 @@ int kvdb_get(kvdb_t d, uint64_t k, uint64_t *v)
 {
 	int ret;
 	struct record_s rec;
+	uint64_t t = stat_begin(d);
 	
-	kvdb_dump_page(d, d->h->root_gpid);
-	ret = bpt_search(d, d->h->root_gpid, k, &rec, NULL);
+	ret = bpt_search(d, k, &rec, NULL);
+	stat_end(d, KVDB_OP_GET, t);
 	if (ret==FOUND_EXACT) {
 		*v = rec.v;
 		return 0;
@@ -621,78 +1891,378 @@ int kvdb_get(kvdb_t d, uint64_t k, uint64_t *v)
 	return -1;
 }
 
+/* start pulling a page read optimistically into the CPU cache */
+static void prefetch_page_lines(struct page_s *p)
+{
+	/* the header and the middle of the keys, find_key() starts there */
+	__builtin_prefetch(p);
+	__builtin_prefetch((char *)p + PAGE_SIZE/8);
+	__builtin_prefetch((char *)p + PAGE_SIZE/4);
+	__builtin_prefetch((char *)p + PAGE_SIZE*3/8);
+}
+
+/*
+ * mget_wave() -- look for up to MGET_WAVE keys with optimistic lock coupling,
+ * one level of the tree at a time for all of them: the children of the next
+ * level are found and prefetched for every key before any of them is read,
+ * so that their misses overlap. If cold, the pages are asked from the kernel
+ * too. A lookup which has to restart is left to bpt_search() with state -1.
+ */
+static void mget_wave(kvdb_t d, const uint64_t *k, int n, uint64_t *val, int *state,
+		int cold)
+{
+	struct page_s *p[MGET_WAVE], *cp[MGET_WAVE];
+	gpid_t gpid[MGET_WAVE], child[MGET_WAVE], pf[MGET_WAVE];
+	uint64_t ver[MGET_WAVE], cv, rk, rv;
+	int i, pos, ret, active, npf;
+	gpid_t root;
+
+	root = __atomic_load_n(&d->h->root_gpid, __ATOMIC_ACQUIRE);
+	if (root==GPID_NIL) {
+		for (i=0; i<n; i++) {
+			state[i] = 0;
+		}
+		return;
+	}
+	for (i=0; i<n; i++) {
+		state[i] = -1;
+	}
+	p[0] = peek_page(d, root);
+	if (p[0]==NULL) {
+		return;
+	}
+	ver[0] = page_version(d, root);
+	if (ver[0]==VER_LOCKED || root!=__atomic_load_n(&d->h->root_gpid, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	for (i=0; i<n; i++) {
+		state[i] = 2;		// on the way down
+		gpid[i] = root;
+		p[i] = p[0];
+		ver[i] = ver[0];
+	}
+
+	for (active=n; active>0; ) {
+		/* find the children of all, and prefetch them */
+		npf = 0;
+		for (i=0; i<n; i++) {
+			if (state[i]!=2) {
+				continue;
+			}
+			ret = olc_step(p[i], k[i], &pos, &child[i]);
+			if (ret<0) {
+				state[i] = -1;
+			} else if (ret==0) {
+				if (pos<0) {
+					state[i] = 0;
+				} else {
+					rk = p[i]->k[pos];
+					rv = p[i]->v[pos];
+					state[i] = (rk==k[i]);
+					if (state[i]) {
+						val[i] = rv;
+					}
+				}
+				if (!page_validate(d, gpid[i], ver[i])) {
+					state[i] = -1;
+				}
+			} else {
+				cp[i] = peek_page(d, child[i]);
+				if (cp[i]==NULL) {
+					state[i] = -1;
+					continue;
+				}
+				prefetch_page_lines(cp[i]);
+				pf[npf++] = child[i];
+				continue;
+			}
+			active --;
+		}
+		if (cold) {
+			prefetch_pages(d, pf, npf);
+		}
+
+		/* step down, validating the parents like bpt_search_olc() */
+		for (i=0; i<n; i++) {
+			if (state[i]!=2) {
+				continue;
+			}
+			cv = page_version(d, child[i]);
+			if (cv==VER_LOCKED || !page_validate(d, gpid[i], ver[i])) {
+				state[i] = -1;
+				active --;
+				continue;
+			}
+			gpid[i] = child[i];
+			p[i] = cp[i];
+			ver[i] = cv;
+		}
+	}
+}
+
+/* major faults of the calling thread, those of others tell nothing of it */
+static long thread_majflt(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_majflt;
+}
+
+/*
+ * kvdb_multi_get() -- look for n keys at once, found[i] tells whether k[i] is
+ * there and v[i] is its value then. The lookups go down the tree together,
+ * MGET_WAVE at a time, see mget_wave(); in the cache modes which could not
+ * read pages optimistically, they are done one by one.
+ *
+ * Asking the kernel for pages costs a system call each, which is only worth
+ * it if they are not in memory. Whether they are is told by the major faults
+ * of the last wave, the first one goes by what the last call of any thread
+ * has met.
+ *
+ * return the number of keys found
+ */
+int kvdb_multi_get(kvdb_t d, const uint64_t *k, int n, uint64_t *v, int *found)
+{
+	struct record_s rec;
+	int state[MGET_WAVE];
+	int i, j, m, num = 0, cold;
+	uint64_t t = stat_begin(d);
+	long flt, f;
+
+	cold = __atomic_load_n(&d->mget_cold, __ATOMIC_RELAXED);
+	flt = thread_majflt();
+	for (i=0; i<n; i+=MGET_WAVE) {
+		m = (n-i<MGET_WAVE) ? n-i : MGET_WAVE;
+		mget_wave(d, &k[i], m, &v[i], state, cold);
+		f = thread_majflt();
+		cold = (f!=flt);
+		flt = f;
+		for (j=0; j<m; j++) {
+			if (state[j]<0) {
+				state[j] = (bpt_search(d, k[i+j], &rec, NULL)==FOUND_EXACT);
+				if (state[j]) {
+					v[i+j] = rec.v;
+				}
+			}
+			found[i+j] = state[j];
+			num += state[j];
+		}
+	}
+	__atomic_store_n(&d->mget_cold, cold, __ATOMIC_RELAXED);
+	stat_end(d, KVDB_OP_MGET, t);
+	return num;
+}
+
 void dump_cursor(kvdb_t db, cursor_t cs)
 {
 	fprintf(stderr, "cursor: cs->gpid=%lu, cs->pg=%p, cs->p=%p, cs->pos=%d\n", 
 			cs->gpid, cs->pg, cs->p, cs->pos);
-	_kvdb_dump_page(cs->gpid, cs->p);
+	if (cs->p!=NULL)
+		_kvdb_dump_page(cs->gpid, cs->p);
+}
+
+/* latch the leaf of the first record not less than k for a cursor */
+static void cursor_seek(kvdb_t db, struct cursor_s *cs, uint64_t k)
+{
+	int ret;
+
+	ret = bpt_search(db, k, NULL, cs);
+	if (cs->gpid==GPID_NIL) {
+		cs->pg = NULL;
+		cs->p = NULL;
+		cs->pos = -1;
+		return;
+	}
+	if (ret==FOUND_GREATER) {
+		cs->pos ++;
+	} else if (cs->pos<0) {
+		cs->pos = 0;
+	}
+}
+
+/*
+ * cursor_resume() -- latch the leaf the cursor has let go again, if nobody
+ * has latched it exclusively since, cs->pos is still right then. Return -1
+ * if the cursor has to look for its next record from the root.
+ */
+static int cursor_resume(kvdb_t db, struct cursor_s *cs)
+{
+	if (cs->gpid==GPID_NIL || cs->ver==VER_LOCKED 
+			|| !page_validate(db, cs->gpid, cs->ver)) {
+		return -1;
+	}
+	cs->pg = latch_get(db, cs->gpid, 0, &cs->p);
+	if (!page_validate(db, cs->gpid, cs->ver)) {
+		latch_put(db, cs->pg);
+		return -1;
+	}
+	return 0;
 }
 
+/*
+ * A cursor keeps no page pinned or latched between the calls, every call
+ * goes on from the first record after the last one returned, so the records
+ * may be changed meanwhile by any thread, the one of the cursor too. The
+ * records of its leaf are copied while it is latched, and returned from the
+ * copy as long as the version of the leaf says nobody has changed it.
+ */
 cursor_t kvdb_open_cursor(kvdb_t db, uint64_t start_key, uint64_t end_key)
 {
 	struct cursor_s *cs;
 
 	cs = malloc(sizeof(*cs));
 	kvdb_assert(cs!=NULL);
+	cs->rec = malloc(RECORD_NUM_PG * sizeof(struct record_s));
+	kvdb_assert(cs->rec!=NULL);
+	cs->rec_num = 0;
 	
 	cs->start_key = start_key;
 	cs->end_key = end_key;
+	cs->next_key = start_key;
+	cs->gpid = GPID_NIL;
+	cs->pg = NULL;
+	cs->p = NULL;
+	cs->pos = -1;
+	cs->ver = VER_LOCKED;
+	cs->ra_end = 0;
+	cs->ra_win = 0;
+	cs->ra_hops = 0;
+	cs->ra_cold = 1;
+	cs->ra_flt = thread_majflt();
+	return cs;
+}
 
-	if (db->h->record_num==0 && db->h->root_gpid==GPID_NIL) {
-		cs->gpid = GPID_NIL;
-		cs->pg = NULL;
-		cs->p = NULL;
-		cs->pos = -1;
-		return cs;
+/*
+ * cursor_readahead() -- called when a cursor has gone from the leaf prev to
+ * the next one. While the leaves follow each other in the file, the window 
+ * of pages read ahead of the cursor doubles up to RA_MAX, and the next run is
+ * asked for when the cursor is half way through the last one, so the reads
+ * are large and ahead of time. Otherwise only the leaf after the next one is
+ * asked for. Nothing is asked for while the thread of the scan meets no major
+ * faults, the leaves are in memory then and the hints would only cost system
+ * calls.
+ */
+static void cursor_readahead(kvdb_t d, struct cursor_s *cs, gpid_t prev)
+{
+	gpid_t start;
+	long flt;
+
+	if (++cs->ra_hops>=RA_CHECK) {
+		flt = thread_majflt();
+		cs->ra_cold = (flt!=cs->ra_flt);
+		cs->ra_flt = flt;
+		cs->ra_hops = 0;
+	}
+	if (!cs->ra_cold) {
+		cs->ra_win = 0;
+		return;
 	}
-	/* 
-	 * the 'pos' in cursor would be -1 if there is not record could be returned, 
-	 * so we do not care about the return value in this case.
-	 */
-	bpt_search(db, db->h->root_gpid, start_key, NULL, cs);
 
-	return cs;
+	if (cs->gpid!=prev+1) {
+		cs->ra_win = 0;
+		if (cs->p->h.next!=GPID_NIL) {
+			prefetch_run(d, cs->p->h.next, 1);
+		}
+		return;
+	}
+	if (cs->ra_win==0) {
+		cs->ra_win = RA_MIN;
+		cs->ra_end = cs->gpid + 1;
+	}
+	if (cs->gpid + cs->ra_win/2 >= cs->ra_end) {
+		start = cs->ra_end > cs->gpid ? cs->ra_end : cs->gpid + 1;
+		cs->ra_end = cs->gpid + 1 + cs->ra_win;
+		prefetch_run(d, start, cs->ra_end - start);
+		if (cs->ra_win<RA_MAX) {
+			cs->ra_win *= 2;
+		}
+	}
 }
 
-
 int kvdb_get_next(kvdb_t db, cursor_t cs, uint64_t *k, uint64_t *v)
 {
-	if (cs->gpid == GPID_NIL) {
-		return -1;
+	struct page_s *p;
+	gpid_t next, prev;
+	int i, ret = -1;
+	pg_t pg;
+
+	if (cs->pos>=0 && cs->pos<cs->rec_num && cs->rec[cs->pos].k<cs->end_key
+			&& page_validate(db, cs->gpid, cs->ver)) {
+		*k = cs->rec[cs->pos].k;
+		*v = cs->rec[cs->pos].v;
+		cs->next_key = *k + 1;
+		cs->pos ++;
+		return 0;
 	}
-	if (cs->pos >= cs->p->h.record_num) {
-		if (cs->p->h.next == GPID_NIL) {
+	if (cursor_resume(db, cs)<0) {
+		prev = cs->gpid;
+		cursor_seek(db, cs, cs->next_key);
+		if (cs->gpid == GPID_NIL) {
+			cs->rec_num = 0;
 			return -1;
 		}
-		put_page(db, cs->pg);
-		cs->gpid = cs->p->h.next;
-		cs->pg = get_page(db, cs->gpid);
-		cs->p = get_page_buf(db, cs->pg);
+		if (prev!=GPID_NIL && cs->gpid!=prev) {
+			cursor_readahead(db, cs, prev);
+		}
+	}
+	while (cs->pos >= cs->p->h.record_num) {
+		next = cs->p->h.next;
+		if (next == GPID_NIL) {
+			goto out;
+		}
+		/* latch the next leaf before releasing this one */
+		pg = latch_get(db, next, 0, &p);
+		latch_put(db, cs->pg);
+		prev = cs->gpid;
+		cs->gpid = next;
+		cs->pg = pg;
+		cs->p = p;
 		cs->pos = 0;
+		cursor_readahead(db, cs, prev);
 	}
 	kvdb_assert((cs->p->h.flags & PAGE_LEAF) != 0);
-	kvdb_assert(cs->p->h.record_num > 0);
-	kvdb_assert(cs->pos < cs->p->h.record_num);
 
-	if (cs->pos==-1) {
-		cs->pos = 0;
+	if (cs->p->k[cs->pos]<cs->end_key) {
+		*k = cs->p->k[cs->pos];
+		*v = cs->p->v[cs->pos];
+		/* *k < end_key, so *k+1 does not wrap */
+		cs->next_key = *k + 1;
+		cs->pos ++;
+		ret = 0;
 	}
-
-	if (cs->p->rec[cs->pos].k>=cs->end_key) {
-		return -1;
+out:
+	cs->ver = page_version(db, cs->gpid);
+	cs->rec_num = 0;
+	if (cs->ver!=VER_LOCKED) {
+		cs->rec_num = cs->p->h.record_num;
+		for (i=cs->pos; i<cs->rec_num; i++) {
+			cs->rec[i].k = cs->p->k[i];
+			cs->rec[i].v = cs->p->v[i];
+		}
 	}
-	
-	*k = cs->p->rec[cs->pos].k;
-	*v = cs->p->rec[cs->pos].v;
-	cs->pos ++;
+	latch_put(db, cs->pg);
+	cs->pg = NULL;
+	cs->p = NULL;
+	return ret;
+}
 
+/*
+ * kvdb_del_next() -- like kvdb_get_next(), and the record returned is deleted.
+ * A record some other thread has deleted first is skipped.
+ */
+int kvdb_del_next(kvdb_t db, cursor_t cs, uint64_t *k, uint64_t *v)
+{
+	do {
+		if (kvdb_get_next(db, cs, k, v)!=0) {
+			return -1;
+		}
+	} while (kvdb_del(db, *k)!=0);
 	return 0;
 }
 
 void kvdb_close_cursor(kvdb_t db, cursor_t cs)
 {
-	if (cs->gpid!=GPID_NIL)
-		put_page(db, cs->pg);
+	free(cs->rec);
 	free(cs);
 }
-
@@ -9,11 +9,90 @@ typedef struct kvdb_s *kvdb_t;
 struct cursor_s;
 typedef struct cursor_s *cursor_t;
 
+struct kvdb_rec_s {
+	uint64_t k;
+	uint64_t v;
+};
+
+/* status of a record put by kvdb_put_batch() */
+#define KVDB_INSERTED	0
+#define KVDB_REPLACED	1
+
+/* how the page cache reaches the file, KVDB_CACHE_DEFAULT is the build's */
+#define KVDB_CACHE_DEFAULT	0
+#define KVDB_CACHE_MMAP_PAGE	1	// mmap() every page on its own
+#define KVDB_CACHE_MMAP_AREA	2	// map the data area once
+#define KVDB_CACHE_DIRECT	3	// own frames, pread()/pwrite() with O_DIRECT
+
+/* options of kvdb_open_ex(), a field left 0 takes its default */
+struct kvdb_opts_s {
+	uint64_t cache_size;	// bytes of pages the cache keeps
+	uint32_t cache_pct;	// or that percentage of the RAM, if cache_size is 0
+	uint32_t cache_mode;	// KVDB_CACHE_*
+};
+
+/* calls timed by kvdb_get_stats(), see stats.c */
+#define KVDB_OP_GET	0
+#define KVDB_OP_PUT	1
+#define KVDB_OP_DEL	2
+#define KVDB_OP_MGET	3	// kvdb_multi_get()
+#define KVDB_OP_BATCH	4	// kvdb_put_batch()
+#define KVDB_OP_NUM	5
+#define KVDB_LAT_NUM	32	// lat[op][i] counts calls of 2^(i-1) to 2^i ns
+#define KVDB_LAT_SAMPLE	64	// one call in that many is timed
+
+/* counters since kvdb_open(), and gauges of now */
+struct kvdb_stats_s {
+	/* page cache */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+	uint64_t cache_writebacks;	// dirty pages written back
+	uint64_t cache_pages;		// pages in the cache
+	uint64_t cache_dirty;
+	uint64_t cache_pinned;
+	uint64_t cache_max;		// pages the cache keeps
+	/* calls on the files */
+	uint64_t msync_calls;
+	uint64_t msync_bytes;
+	uint64_t fsync_calls;		// fsync() and fdatasync()
+	uint64_t fallocate_calls;	// growing the file and punching holes
+	uint64_t fallocate_bytes;
+	uint64_t pwrite_calls;		// CACHE_DIRECT write back
+	uint64_t pwrite_bytes;
+	uint64_t pread_calls;		// CACHE_DIRECT misses
+	uint64_t pread_bytes;
+	uint64_t log_writes;
+	uint64_t log_bytes;
+	/* tree and allocator */
+	uint64_t splits;
+	uint64_t merges;
+	uint64_t page_allocs;
+	uint64_t page_frees;
+	uint64_t records;
+	uint64_t height;
+	uint64_t pages;			// pages in use
+	uint64_t file_size;
+	uint32_t fill_pct;		// records against what the pages could hold
+	/* calls of the API, a sample of them timed */
+	uint64_t ops[KVDB_OP_NUM];
+	uint64_t lat[KVDB_OP_NUM][KVDB_LAT_NUM];
+};
+
 kvdb_t kvdb_open(char *name);
+kvdb_t kvdb_open_ex(char *name, const struct kvdb_opts_s *opts);
 int kvdb_close(kvdb_t db);
+int kvdb_set_cache_size(kvdb_t db, uint64_t size);
 int kvdb_get(kvdb_t db, uint64_t k, uint64_t *v);
+int kvdb_multi_get(kvdb_t db, const uint64_t *k, int n, uint64_t *v, int *found);
 int kvdb_put(kvdb_t db, uint64_t k, uint64_t v);
 int kvdb_del(kvdb_t db, uint64_t k);
+uint64_t kvdb_del_range(kvdb_t db, uint64_t start_key, uint64_t end_key);
+int kvdb_put_batch(kvdb_t db, struct kvdb_rec_s *rec, int n, int *status);
+int kvdb_bulk_load(kvdb_t db, int (*next)(void *arg, uint64_t *k, uint64_t *v),
+		void *arg, int fill);
+uint64_t kvdb_compact(kvdb_t db);
+int kvdb_get_stats(kvdb_t db, struct kvdb_stats_s *st);
 
 cursor_t kvdb_open_cursor(kvdb_t db, uint64_t start_key, uint64_t end_key);
 int kvdb_get_next(kvdb_t db, cursor_t cs, uint64_t *k, uint64_t *v);
@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "inner.h"
+
+/*
+ * The redo log is an append-only file next to the database, "<name>.log".
+ * Every kvdb_put()/kvdb_del() appends a record while it holds the latch of
+ * the leaf it changes, so the records of any key are in the order the tree
+ * is changed in, and waits for the record to be durable after it has
+ * released its latches. kvdb_del_range() logs one record for a range while
+ * it holds d->lock exclusively, nothing else changes the tree then. The first
+ * waiter becomes the leader, it writes all the records appended so far and
+ * calls fdatasync() once for all of them, the others just wait for it.
+ *
+ * The records say what has been done to the tree, they could not repair one
+ * whose pages reached the disk in part: pages, the header and the bitmaps
+ * are written back between checkpoints whenever the cache or the kernel
+ * likes. So the image a page had at the last checkpoint is logged as well,
+ * before it is changed for the first time after it, see log_page(), and the
+ * first record after a checkpoint is the image of the file header. Recovery
+ * writes the images back, which brings the file back to the checkpoint but
+ * for the bitmaps, rebuilds those from the tree and replays the records.
+ *
+ * The log is emptied by a checkpoint, after all pages, the allocator and the
+ * file header have been synced to the database file.
+ */
+
+#define LOG_BUF_INIT	(64*1024)		// bytes
+#define LOG_CKPT_SIZE	(64ULL*1024*1024)	// checkpoint when the log is larger
+#define LOGGED_INIT	(1024)			// slots of the table of pages logged
+
+struct log_s {
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf;			// records appended but not written yet
+	char *wbuf;			// records being written by the leader
+	uint64_t len;			// bytes in buf
+	uint64_t cap;
+	uint64_t wcap;
+	int flushing;			// a leader is writing wbuf
+	uint64_t next_lsn;		// lsn of the next record
+	uint64_t durable_lsn;		// all records below it are on disk
+	uint64_t size;			// bytes appended since the last checkpoint
+	uint64_t end;			// bytes found in the log when it is opened
+	uint64_t *logged;		// positions + 1 of the pages not to log again
+	uint64_t logged_mask;
+	uint64_t logged_num;
+};
+
+static uint64_t rec_crc(struct log_rec_s *r)
+{
+	return kv_crc64((const unsigned char *)r, offsetof(struct log_rec_s, crc));
+}
+
+static uint64_t pos_hash(uint64_t pos, uint64_t mask)
+{
+	return (((pos / PAGE_SIZE) * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+/* whether the page at pos is in the table of pages logged, lg->lock held */
+static int logged_find(struct log_s *lg, uint64_t pos)
+{
+	uint64_t i;
+
+	for (i=pos_hash(pos, lg->logged_mask); lg->logged[i]!=0;
+			i=(i+1) & lg->logged_mask) {
+		if (lg->logged[i]==pos + 1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* add the page at pos to the table, return 0 if it is there already */
+static int logged_add(struct log_s *lg, uint64_t pos)
+{
+	uint64_t *old = lg->logged, n = lg->logged_mask + 1, i, j;
+
+	if (logged_find(lg, pos)) {
+		return 0;
+	}
+	/* keep the table at most half full */
+	if (2*(lg->logged_num + 1)>n) {
+		lg->logged = (uint64_t *)calloc(2*n, sizeof(uint64_t));
+		kvdb_assert(lg->logged!=NULL);
+		lg->logged_mask = 2*n - 1;
+		for (j=0; j<n; j++) {
+			if (old[j]==0) {
+				continue;
+			}
+			for (i=pos_hash(old[j] - 1, lg->logged_mask); lg->logged[i]!=0;
+					i=(i+1) & lg->logged_mask)
+				;
+			lg->logged[i] = old[j];
+		}
+		free(old);
+	}
+	for (i=pos_hash(pos, lg->logged_mask); lg->logged[i]!=0; 
+			i=(i+1) & lg->logged_mask)
+		;
+	lg->logged[i] = pos + 1;
+	lg->logged_num ++;
+	return 1;
+}
+
+static void logged_clear(struct log_s *lg)
+{
+	if (lg->logged_mask + 1>LOGGED_INIT) {
+		free(lg->logged);
+		lg->logged = (uint64_t *)malloc(LOGGED_INIT * sizeof(uint64_t));
+		kvdb_assert(lg->logged!=NULL);
+		lg->logged_mask = LOGGED_INIT - 1;
+	}
+	memset(lg->logged, 0, (lg->logged_mask + 1) * sizeof(uint64_t));
+	lg->logged_num = 0;
+}
+
+void init_log(kvdb_t db, const char *name)
+{
+	struct log_s *lg;
+	char *path;
+
+	lg = (struct log_s *)malloc(sizeof(*lg));
+	kvdb_assert(lg!=NULL);
+	memset(lg, 0, sizeof(*lg));
+
+	path = (char *)malloc(strlen(name) + 5);
+	kvdb_assert(path!=NULL);
+	sprintf(path, "%s.log", name);
+	lg->fd = open(path, O_CREAT|O_RDWR|O_APPEND, 0666);
+	kvdb_assert(lg->fd>=0);
+	free(path);
+
+	lg->cap = lg->wcap = LOG_BUF_INIT;
+	lg->buf = (char *)malloc(lg->cap);
+	lg->wbuf = (char *)malloc(lg->wcap);
+	kvdb_assert(lg->buf!=NULL && lg->wbuf!=NULL);
+	lg->logged = (uint64_t *)calloc(LOGGED_INIT, sizeof(uint64_t));
+	kvdb_assert(lg->logged!=NULL);
+	lg->logged_mask = LOGGED_INIT - 1;
+	lg->next_lsn = 1;
+	lg->durable_lsn = 1;
+	pthread_mutex_init(&lg->lock, NULL);
+	pthread_cond_init(&lg->cond, NULL);
+	db->lg = lg;
+}
+
+void exit_log(kvdb_t db)
+{
+	struct log_s *lg = db->lg;
+
+	kvdb_assert(lg->flushing==0);
+	close(lg->fd);
+	free(lg->buf);
+	free(lg->wbuf);
+	free(lg->logged);
+	pthread_mutex_destroy(&lg->lock);
+	pthread_cond_destroy(&lg->cond);
+	free(lg);
+	db->lg = NULL;
+}
+
+/* the log is emptied by a close, it holds something after a crash */
+int log_is_empty(kvdb_t db)
+{
+	struct stat st;
+	int ret;
+
+	ret = fstat(db->lg->fd, &st);
+	kvdb_assert(ret==0);
+	return st.st_size==0;
+}
+
+/*
+ * read_rec() -- read the record at pos into r, and the image which follows
+ * a LOG_PAGE one into img. Return the bytes it takes, 0 if it is torn.
+ */
+static uint64_t read_rec(struct log_s *lg, uint64_t pos, struct log_rec_s *r,
+		void *img)
+{
+	ssize_t ret;
+
+	ret = pread(lg->fd, r, sizeof(*r), pos);
+	if (ret!=(ssize_t)sizeof(*r) || r->crc!=rec_crc(r))
+		return 0;
+	if (r->op!=LOG_PAGE)
+		return sizeof(*r);
+	ret = pread(lg->fd, img, PAGE_SIZE, pos + sizeof(*r));
+	if (ret!=(ssize_t)PAGE_SIZE || r->v!=kv_crc64(img, PAGE_SIZE))
+		return 0;
+	return sizeof(*r) + PAGE_SIZE;
+}
+
+/*
+ * restore_pages() -- write the images in the log back to the database file,
+ * before anything of it is mapped. Only the first image of a page counts, a
+ * later one may have been logged by a recovery cut short, after the page
+ * had been written back. The images stay in the log until the checkpoint
+ * after the recovery, so the pages are not logged again meanwhile. The log
+ * is cut after the last record which is whole and in sequence, nothing is
+ * appended after a torn one.
+ *
+ * Returns the number of pages written back.
+ */
+uint64_t restore_pages(kvdb_t db)
+{
+	struct log_s *lg = db->lg;
+	struct log_rec_s r;
+	uint64_t num = 0, pos, len;
+	struct stat st;
+	void *img = NULL;
+	int ret;
+
+	ret = posix_memalign(&img, PAGE_SIZE, PAGE_SIZE);	// O_DIRECT
+	kvdb_assert(ret==0);
+	for (pos=0; ; pos+=len) {
+		len = read_rec(lg, pos, &r, img);
+		if (len==0 || (pos>0 && r.lsn!=lg->next_lsn))
+			break;
+		lg->next_lsn = r.lsn + 1;
+		if (r.op==LOG_PAGE && logged_add(lg, r.k)) {
+			ret = pwrite(db->fd, img, PAGE_SIZE, r.k);
+			kvdb_assert(ret==PAGE_SIZE);
+			stat_add(db, STAT_PWRITE, 1);
+			stat_add(db, STAT_PWRITE_BYTES, PAGE_SIZE);
+			num ++;
+		}
+	}
+	free(img);
+
+	ret = fstat(lg->fd, &st);
+	kvdb_assert(ret==0);
+	if ((uint64_t)st.st_size>pos) {
+		ret = ftruncate(lg->fd, pos);
+		kvdb_assert(ret==0);
+	}
+	lg->end = pos;
+	lg->size = pos;
+	lg->durable_lsn = lg->next_lsn;
+	return num;
+}
+
+/*
+ * replay_log() -- call fn for every record restore_pages() has found in the
+ * log but the images. Returns the number of records replayed.
+ */
+uint64_t replay_log(kvdb_t db, void (*fn)(kvdb_t, struct log_rec_s *))
+{
+	struct log_s *lg = db->lg;
+	struct log_rec_s r;
+	uint64_t num = 0, pos;
+	ssize_t ret;
+
+	for (pos=0; pos<lg->end; pos+=sizeof(r)) {
+		ret = pread(lg->fd, &r, sizeof(r), pos);
+		kvdb_assert(ret==(ssize_t)sizeof(r));
+		if (r.op==LOG_PAGE) {
+			pos += PAGE_SIZE;
+			continue;
+		}
+		fn(db, &r);
+		num ++;
+	}
+	return num;
+}
+
+/* room for len bytes more in the log buffer, lg->lock is held */
+static char *log_reserve(struct log_s *lg, uint64_t len)
+{
+	char *p;
+
+	while (lg->len + len>lg->cap) {
+		lg->cap *= 2;
+		lg->buf = (char *)realloc(lg->buf, lg->cap);
+		kvdb_assert(lg->buf!=NULL);
+	}
+	p = lg->buf + lg->len;
+	lg->len += len;
+	lg->size += len;
+	return p;
+}
+
+/* fill in a record reserved in the buffer, return its lsn */
+static uint64_t fill_rec(struct log_s *lg, struct log_rec_s *r, uint32_t op,
+		uint64_t k, uint64_t v)
+{
+	r->lsn = lg->next_lsn ++;
+	r->op = op;
+	r->reserve = 0;
+	r->k = k;
+	r->v = v;
+	r->crc = rec_crc(r);
+	return r->lsn;
+}
+
+/* append a record to the log buffer, return its lsn */
+uint64_t log_append(kvdb_t db, uint32_t op, uint64_t k, uint64_t v)
+{
+	struct log_s *lg = db->lg;
+	struct log_rec_s *r;
+	uint64_t lsn;
+
+	pthread_mutex_lock(&lg->lock);
+	r = (struct log_rec_s *)log_reserve(lg, sizeof(*r));
+	lsn = fill_rec(lg, r, op, k, v);
+	pthread_mutex_unlock(&lg->lock);
+	return lsn;
+}
+
+/*
+ * log_page() -- log the image of the page at pos, which is about to be
+ * changed, unless it has been since the last checkpoint, and wait until it
+ * is durable: the page could reach the disk as soon as it is changed. The
+ * caller keeps everybody else from changing it meanwhile.
+ */
+void log_page(kvdb_t db, uint64_t pos, const void *buf)
+{
+	struct log_s *lg = db->lg;
+	struct log_rec_s *r;
+	uint64_t lsn, crc;
+	int found;
+
+	pthread_mutex_lock(&lg->lock);
+	found = logged_find(lg, pos);
+	pthread_mutex_unlock(&lg->lock);
+	if (found) {
+		return;
+	}
+	crc = kv_crc64(buf, PAGE_SIZE);
+
+	pthread_mutex_lock(&lg->lock);
+	logged_add(lg, pos);
+	r = (struct log_rec_s *)log_reserve(lg, sizeof(*r) + PAGE_SIZE);
+	memcpy(r + 1, buf, PAGE_SIZE);
+	lsn = fill_rec(lg, r, LOG_PAGE, pos, crc);
+	pthread_mutex_unlock(&lg->lock);
+	log_commit(db, lsn);
+}
+
+/*
+ * log_new_pages() -- n pages from pos on have just been handed out by the
+ * allocator. They are in no tree of the last checkpoint, those which were
+ * have been logged before they were freed, so they are not logged.
+ */
+void log_new_pages(kvdb_t db, uint64_t pos, uint32_t n)
+{
+	struct log_s *lg = db->lg;
+	uint32_t i;
+
+	pthread_mutex_lock(&lg->lock);
+	for (i=0; i<n; i++) {
+		logged_add(lg, pos + i*PAGE_SIZE);
+	}
+	pthread_mutex_unlock(&lg->lock);
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	ssize_t ret;
+
+	while (len>0) {
+		ret = write(fd, p, len);
+		kvdb_assert(ret>0);
+		p += ret;
+		len -= ret;
+	}
+}
+
+/*
+ * log_commit() -- wait until the record 'lsn' is durable, or make it durable
+ * together with everything else in the buffer if no one is writing the log.
+ */
+void log_commit(kvdb_t db, uint64_t lsn)
+{
+	struct log_s *lg = db->lg;
+	uint64_t end, len;
+	char *t;
+	int ret;
+
+	pthread_mutex_lock(&lg->lock);
+	while (lg->durable_lsn<=lsn) {
+		if (lg->flushing) {
+			pthread_cond_wait(&lg->cond, &lg->lock);
+			continue;
+		}
+		/* become the leader, take the whole buffer */
+		t = lg->wbuf; lg->wbuf = lg->buf; lg->buf = t;
+		len = lg->cap; lg->cap = lg->wcap; lg->wcap = len;
+		len = lg->len;
+		lg->len = 0;
+		end = lg->next_lsn;
+		lg->flushing = 1;
+		pthread_mutex_unlock(&lg->lock);
+
+		write_all(lg->fd, lg->wbuf, len);
+		ret = fdatasync(lg->fd);
+		kvdb_assert(ret==0);
+		stat_add(db, STAT_LOG_WRITE, 1);
+		stat_add(db, STAT_LOG_BYTES, len);
+		stat_add(db, STAT_FSYNC, 1);
+
+		pthread_mutex_lock(&lg->lock);
+		lg->flushing = 0;
+		if (end>lg->durable_lsn)
+			lg->durable_lsn = end;
+		pthread_cond_broadcast(&lg->cond);
+	}
+	pthread_mutex_unlock(&lg->lock);
+}
+
+int log_need_checkpoint(kvdb_t db)
+{
+	return db->lg->size>=LOG_CKPT_SIZE;
+}
+
+/*
+ * reset_log() -- empty the log at a checkpoint. The caller holds db->lock
+ * exclusively and has made the database file durable, so every record
+ * appended so far is covered by it, even the ones still in the buffer, and
+ * no page has to be logged again until it is changed.
+ */
+void reset_log(kvdb_t db)
+{
+	struct log_s *lg = db->lg;
+	int ret;
+
+	pthread_mutex_lock(&lg->lock);
+	while (lg->flushing) {
+		pthread_cond_wait(&lg->cond, &lg->lock);
+	}
+	ret = ftruncate(lg->fd, 0);
+	kvdb_assert(ret==0);
+	ret = fdatasync(lg->fd);
+	kvdb_assert(ret==0);
+	stat_add(db, STAT_FSYNC, 1);
+	lg->len = 0;
+	lg->size = 0;
+	lg->end = 0;
+	logged_clear(lg);
+	lg->durable_lsn = lg->next_lsn;
+	pthread_cond_broadcast(&lg->cond);
+	pthread_mutex_unlock(&lg->lock);
+}
@@ -16,7 +16,10 @@ void usage(void)
 		"    kv del <key>              -- delete a key\n"\
 		"    kv list                   -- list all key in the db\n"\
 		"    kv ins <start_key> <num>  -- insert records in batch mode\n"\
+		"    kv load <file> [fill]     -- bulk load \"key value\" lines into an empty db\n"\
 		"    kv clr                    -- remove all records in the database\n"\
+		"    kv compact                -- move pages to the front and shrink the file\n"\
+		"    kv stats                  -- print the statistics of the engine\n"\
 		"    kv verify                 -- get all records and verify them\n"\
 		);
 }
@@ -83,6 +86,7 @@ static int fn_dump(kvdb_t d, int argc, char *argv[])
 {
 	expect(argc, 2);
 	kvdb_dump(d);
+	return 0;
 }
 
 static int fn_list(kvdb_t d, int argc, char *argv[])
@@ -135,8 +139,119 @@ static int fn_ins(kvdb_t d, int argc, char *argv[])
 	return 0;
 }
 
+static int next_line(void *arg, uint64_t *k, uint64_t *v)
+{
+	FILE *f = (FILE *)arg;
+
+	return (fscanf(f, "%lu %lu", k, v)==2) ? 0 : -1;
+}
+
+static int fn_load(kvdb_t d, int argc, char *argv[])
+{
+	FILE *f;
+	int fill = 0;
+	time_t t0;
+
+	if (argc!=3) {
+		expect(argc, 4);
+		fill = atoi(argv[3]);
+	}
+	f = strcmp(argv[2], "-")==0 ? stdin : fopen(argv[2], "r");
+	if (f==NULL) {
+		fprintf(stderr, "cannot open %s\n", argv[2]);
+		return -1;
+	}
+	t0 = time(NULL);
+	if (kvdb_bulk_load(d, next_line, f, fill)!=0) {
+		printf("the database is not empty\n");
+	} else {
+		printf("loaded in %lu sec\n", time(NULL) - t0);
+	}
+	if (f!=stdin) {
+		fclose(f);
+	}
+	return 0;
+}
+
 static int fn_clr(kvdb_t d, int argc, char *argv[])
 {
+	uint64_t n;
+
+	expect(argc, 2);
+	n = kvdb_del_range(d, 0, (uint64_t)(-1));
+	n += (kvdb_del(d, (uint64_t)(-1))==0);
+	printf("%lu records removed\n", n);
+	return 0;
+}
+
+static int fn_compact(kvdb_t d, int argc, char *argv[])
+{
+	uint64_t n;
+
+	expect(argc, 2);
+	n = kvdb_compact(d);
+	printf("%lu pages moved\n", n);
+	return 0;
+}
+
+/* the upper bound of the latency bucket the p-th fraction of calls falls in */
+static uint64_t lat_pct(const uint64_t *lat, uint64_t num, double p)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i=0; i<KVDB_LAT_NUM; i++) {
+		sum += lat[i];
+		if (sum>=p*num)
+			break;
+	}
+	return 1ULL << i;
+}
+
+static int fn_stats(kvdb_t d, int argc, char *argv[])
+{
+	static const char *ops[KVDB_OP_NUM] = {"get", "put", "del", "mget", "batch"};
+	struct kvdb_stats_s st;
+	uint64_t num;
+	int i, j;
+
+	expect(argc, 2);
+	kvdb_get_stats(d, &st);
+	printf("records         %lu\n", st.records);
+	printf("height          %lu\n", st.height);
+	printf("pages           %lu\n", st.pages);
+	printf("fill            %u%%\n", st.fill_pct);
+	printf("file size       %lu\n", st.file_size);
+	printf("cache           %lu/%lu pages, %lu dirty, %lu pinned\n", 
+		st.cache_pages, st.cache_max, st.cache_dirty, st.cache_pinned);
+	printf("cache hits      %lu\n", st.cache_hits);
+	printf("cache misses    %lu\n", st.cache_misses);
+	printf("evictions       %lu\n", st.cache_evictions);
+	printf("writebacks      %lu\n", st.cache_writebacks);
+	printf("msync           %lu calls, %lu bytes\n", st.msync_calls, st.msync_bytes);
+	printf("fsync           %lu calls\n", st.fsync_calls);
+	printf("fallocate       %lu calls, %lu bytes\n", st.fallocate_calls, st.fallocate_bytes);
+	printf("pwrite          %lu calls, %lu bytes\n", st.pwrite_calls, st.pwrite_bytes);
+	printf("pread           %lu calls, %lu bytes\n", st.pread_calls, st.pread_bytes);
+	printf("log             %lu writes, %lu bytes\n", st.log_writes, st.log_bytes);
+	printf("splits          %lu\n", st.splits);
+	printf("merges          %lu\n", st.merges);
+	printf("page allocs     %lu\n", st.page_allocs);
+	printf("page frees      %lu\n", st.page_frees);
+	for (i=0; i<KVDB_OP_NUM; i++) {
+		if (st.ops[i]==0)
+			continue;
+		for (num=0, j=0; j<KVDB_LAT_NUM; j++) {
+			num += st.lat[i][j];
+		}
+		printf("%-6s          %lu calls", ops[i], st.ops[i]);
+		if (num>0) {
+			printf(", p50 < %lu ns, p99 < %lu ns, p99.9 < %lu ns", 
+				lat_pct(st.lat[i], num, 0.5), lat_pct(st.lat[i], num, 0.99),
+				lat_pct(st.lat[i], num, 0.999));
+		}
+		printf("\n");
+	}
 	return 0;
 }
 
@@ -152,7 +267,10 @@ static struct cmd_s cmds[] = {
 	{"list", fn_list}, 
 	{"dump", fn_dump},
 	{"ins", fn_ins}, 
-	{"ins", fn_clr}, 
+	{"load", fn_load}, 
+	{"clr", fn_clr}, 
+	{"compact", fn_compact}, 
+	{"stats", fn_stats}, 
 	{"verify", fn_verify}, 
 	{NULL, NULL},
 };
@@ -0,0 +1,171 @@
+#include <stdint.h>
+
+#include "inner.h"
+
+/*
+ * Kernels used by find_key() and br_find(): count the keys in a small window
+ * of a page which are not greater than k, 64-bit keys of leaves and wide 
+ * branch pages, or 32-bit deltas of compact branch pages. The window is a 
+ * few cache lines, the kernels go through it without a branch on the keys.
+ * init_search() picks the best ones the CPU supports.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+static int count_le_scalar(const uint64_t *keys, int n, uint64_t k)
+{
+	int i, c = 0;
+
+	for (i=0; i<n; i++) {
+		c += (keys[i] <= k);
+	}
+	return c;
+}
+
+static int count32_le_scalar(const uint32_t *keys, int n, uint32_t k)
+{
+	int i, c = 0;
+
+	for (i=0; i<n; i++) {
+		c += (keys[i] <= k);
+	}
+	return c;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*
+ * SSE and AVX2 only compare signed integers, so the sign bits of
+ * both sides are flipped first.
+ */
+__attribute__((target("sse4.2")))
+static int count_le_sse42(const uint64_t *keys, int n, uint64_t k)
+{
+	const __m128i sign = _mm_set1_epi64x((long long)(1ULL<<63));
+	__m128i kv = _mm_xor_si128(_mm_set1_epi64x((long long)k), sign);
+	__m128i x;
+	int i, c = 0;
+
+	for (i=0; i+2<=n; i+=2) {
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&keys[i]), sign);
+		c += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(x, kv))));
+	}
+	c = i - c;
+	if (i<n) {
+		c += (keys[i] <= k);
+	}
+	return c;
+}
+
+__attribute__((target("avx2")))
+static int count_le_avx2(const uint64_t *keys, int n, uint64_t k)
+{
+	const __m256i sign = _mm256_set1_epi64x((long long)(1ULL<<63));
+	__m256i kv = _mm256_xor_si256(_mm256_set1_epi64x((long long)k), sign);
+	__m256i x;
+	int i, c = 0;
+
+	for (i=0; i+4<=n; i+=4) {
+		x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&keys[i]), sign);
+		c += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, kv))));
+	}
+	c = i - c;
+	for (; i<n; i++) {
+		c += (keys[i] <= k);
+	}
+	return c;
+}
+
+__attribute__((target("avx512f")))
+static int count_le_avx512(const uint64_t *keys, int n, uint64_t k)
+{
+	__m512i kv = _mm512_set1_epi64((long long)k);
+	__m512i x;
+	__mmask8 m;
+	int i, c = 0;
+
+	/* the last load is masked, it never touches anything beyond keys[n-1] */
+	for (i=0; i<n; i+=8) {
+		m = (n-i>=8) ? 0xff : (__mmask8)((1u<<(n-i)) - 1);
+		x = _mm512_maskz_loadu_epi64(m, &keys[i]);
+		c += __builtin_popcount(_mm512_mask_cmple_epu64_mask(m, x, kv));
+	}
+	return c;
+}
+
+__attribute__((target("sse4.2")))
+static int count32_le_sse42(const uint32_t *keys, int n, uint32_t k)
+{
+	const __m128i sign = _mm_set1_epi32((int)(1U<<31));
+	__m128i kv = _mm_xor_si128(_mm_set1_epi32((int)k), sign);
+	__m128i x;
+	int i, c = 0;
+
+	for (i=0; i+4<=n; i+=4) {
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&keys[i]), sign);
+		c += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(x, kv))));
+	}
+	c = i - c;
+	for (; i<n; i++) {
+		c += (keys[i] <= k);
+	}
+	return c;
+}
+
+__attribute__((target("avx2")))
+static int count32_le_avx2(const uint32_t *keys, int n, uint32_t k)
+{
+	const __m256i sign = _mm256_set1_epi32((int)(1U<<31));
+	__m256i kv = _mm256_xor_si256(_mm256_set1_epi32((int)k), sign);
+	__m256i x;
+	int i, c = 0;
+
+	for (i=0; i+8<=n; i+=8) {
+		x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&keys[i]), sign);
+		c += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, kv))));
+	}
+	c = i - c;
+	for (; i<n; i++) {
+		c += (keys[i] <= k);
+	}
+	return c;
+}
+
+__attribute__((target("avx512f")))
+static int count32_le_avx512(const uint32_t *keys, int n, uint32_t k)
+{
+	__m512i kv = _mm512_set1_epi32((int)k);
+	__m512i x;
+	__mmask16 m;
+	int i, c = 0;
+
+	for (i=0; i<n; i+=16) {
+		m = (n-i>=16) ? 0xffff : (__mmask16)((1u<<(n-i)) - 1);
+		x = _mm512_maskz_loadu_epi32(m, &keys[i]);
+		c += __builtin_popcount(_mm512_mask_cmple_epu32_mask(m, x, kv));
+	}
+	return c;
+}
+#endif
+
+int (*count_keys_le)(const uint64_t *keys, int n, uint64_t k) = count_le_scalar;
+int (*count_keys32_le)(const uint32_t *keys, int n, uint32_t k) = count32_le_scalar;
+
+void init_search(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		count_keys_le = count_le_avx512;
+		count_keys32_le = count32_le_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		count_keys_le = count_le_avx2;
+		count_keys32_le = count32_le_avx2;
+	} else if (__builtin_cpu_supports("sse4.2")) {
+		count_keys_le = count_le_sse42;
+		count_keys32_le = count32_le_sse42;
+	}
+#endif
+}
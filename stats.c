@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "inner.h"
+
+/*
+ * Engine statistics. Every thread counts into a block of its own, without
+ * atomics or shared cache lines, and kvdb_get_stats() adds all the blocks of
+ * a database up. A thread finds its block through stats_tls, which remembers
+ * the last database it has counted for by the id it has been opened with, so
+ * that a database opened again at the same address is not mistaken for it.
+ * The blocks are freed when the database is closed.
+ */
+
+struct stats_s {
+	uint64_t c[STAT_NUM];
+	uint64_t ops[KVDB_OP_NUM];
+	uint64_t lat[KVDB_OP_NUM][KVDB_LAT_NUM];
+	uint32_t tick;			// calls until the next one is timed
+	pthread_t owner;
+	struct stats_s *next;
+};
+
+static __thread struct {
+	uint64_t id;			// stats_id of the database, 0 for none
+	struct stats_s *s;
+} stats_tls;
+
+static uint64_t stats_ids;
+
+void init_stats(kvdb_t db)
+{
+	db->stats_id = __atomic_add_fetch(&stats_ids, 1, __ATOMIC_RELAXED);
+	db->stats = NULL;
+	pthread_mutex_init(&db->stats_lock, NULL);
+}
+
+void exit_stats(kvdb_t db)
+{
+	struct stats_s *s;
+
+	while (db->stats!=NULL) {
+		s = db->stats;
+		db->stats = s->next;
+		free(s);
+	}
+	pthread_mutex_destroy(&db->stats_lock);
+	if (stats_tls.id==db->stats_id) {
+		stats_tls.id = 0;
+		stats_tls.s = NULL;
+	}
+}
+
+/* the block of this thread, when stats_tls is for another database */
+static struct stats_s *thread_stats(kvdb_t db)
+{
+	struct stats_s *s;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&db->stats_lock);
+	for (s=db->stats; s!=NULL; s=s->next) {
+		if (pthread_equal(s->owner, self))
+			break;
+	}
+	if (s==NULL) {
+		s = (struct stats_s *)calloc(1, sizeof(*s));
+		kvdb_assert(s!=NULL);
+		s->owner = self;
+		s->tick = KVDB_LAT_SAMPLE;
+		s->next = db->stats;
+		db->stats = s;
+	}
+	pthread_mutex_unlock(&db->stats_lock);
+	stats_tls.id = db->stats_id;
+	stats_tls.s = s;
+	return s;
+}
+
+static inline struct stats_s *my_stats(kvdb_t db)
+{
+	if (stats_tls.id==db->stats_id)
+		return stats_tls.s;
+	return thread_stats(db);
+}
+
+void stat_add(kvdb_t db, int i, uint64_t n)
+{
+	struct stats_s *s = my_stats(db);
+
+	__atomic_store_n(&s->c[i], s->c[i] + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * stat_begin() and stat_end() go around a call of the API. Reading the clock
+ * costs about as much as a cached lookup, so only one call in KVDB_LAT_SAMPLE
+ * is timed, stat_begin() returns 0 for the others.
+ */
+uint64_t stat_begin(kvdb_t db)
+{
+	struct stats_s *s = my_stats(db);
+
+	if (--s->tick>0) {
+		return 0;
+	}
+	s->tick = KVDB_LAT_SAMPLE;
+	return now_ns();
+}
+
+void stat_end(kvdb_t db, int op, uint64_t start)
+{
+	struct stats_s *s = my_stats(db);
+	uint64_t ns;
+	int i;
+
+	__atomic_store_n(&s->ops[op], s->ops[op] + 1, __ATOMIC_RELAXED);
+	if (start==0) {
+		return;
+	}
+	ns = now_ns() - start;
+	i = 64 - __builtin_clzll(ns | 1);
+	i = i<KVDB_LAT_NUM ? i : KVDB_LAT_NUM - 1;
+	__atomic_store_n(&s->lat[op][i], s->lat[op][i] + 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(uint64_t *x)
+{
+	return __atomic_load_n(x, __ATOMIC_RELAXED);
+}
+
+/*
+ * kvdb_get_stats() -- the counters since the database has been opened, and
+ * the state of the cache, the tree and the file now. The counters of threads
+ * still running may be a few calls behind.
+ */
+int kvdb_get_stats(kvdb_t db, struct kvdb_stats_s *st)
+{
+	uint64_t c[STAT_NUM];
+	struct stats_s *s;
+	uint64_t cap;
+	int i, j;
+
+	memset(st, 0, sizeof(*st));
+	memset(c, 0, sizeof(c));
+	pthread_mutex_lock(&db->stats_lock);
+	for (s=db->stats; s!=NULL; s=s->next) {
+		for (i=0; i<STAT_NUM; i++) {
+			c[i] += load(&s->c[i]);
+		}
+		for (i=0; i<KVDB_OP_NUM; i++) {
+			st->ops[i] += load(&s->ops[i]);
+			for (j=0; j<KVDB_LAT_NUM; j++) {
+				st->lat[i][j] += load(&s->lat[i][j]);
+			}
+		}
+	}
+	pthread_mutex_unlock(&db->stats_lock);
+
+	st->cache_hits = c[STAT_CACHE_HIT];
+	st->cache_misses = c[STAT_CACHE_MISS];
+	st->cache_evictions = c[STAT_CACHE_EVICT];
+	st->cache_writebacks = c[STAT_CACHE_WRITEBACK];
+	st->msync_calls = c[STAT_MSYNC];
+	st->msync_bytes = c[STAT_MSYNC_BYTES];
+	st->fsync_calls = c[STAT_FSYNC];
+	st->fallocate_calls = c[STAT_FALLOCATE];
+	st->fallocate_bytes = c[STAT_FALLOCATE_BYTES];
+	st->pwrite_calls = c[STAT_PWRITE];
+	st->pwrite_bytes = c[STAT_PWRITE_BYTES];
+	st->pread_calls = c[STAT_PREAD];
+	st->pread_bytes = c[STAT_PREAD_BYTES];
+	st->log_writes = c[STAT_LOG_WRITE];
+	st->log_bytes = c[STAT_LOG_BYTES];
+	st->splits = c[STAT_SPLIT];
+	st->merges = c[STAT_MERGE];
+	st->page_allocs = c[STAT_PAGE_ALLOC];
+	st->page_frees = c[STAT_PAGE_FREE];
+	get_cache_stats(db, st);
+
+	pthread_rwlock_rdlock(&db->root_latch);
+	st->height = db->h->level;
+	pthread_rwlock_unlock(&db->root_latch);
+	st->records = __atomic_load_n(&db->h->record_num, __ATOMIC_RELAXED);
+	st->file_size = db->h->file_size;
+	st->pages = used_pages(db);
+	cap = st->pages * RECORD_NUM_PG;
+	st->fill_pct = cap>0 ? (uint32_t)(st->records * 100 / cap) : 0;
+	return 0;
+}